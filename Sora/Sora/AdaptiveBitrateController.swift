@@ -0,0 +1,329 @@
+import Foundation
+import WebRTC
+
+// 映像の送信ビットレートを調整する方針
+// ビットレートの単位は kbps
+public struct AdaptiveBitratePolicy {
+    
+    public var minBitRate: Int = 100
+    public var maxBitRate: Int = 2500
+    
+    // ビットレートを上げるときに現在のビットレートに加える割合
+    public var increaseRate: Double = 0.08
+    
+    // ビットレートを下げるときに現在のビットレートから減らす割合
+    public var decreaseRate: Double = 0.15
+    
+    // パケットロス率がこの値以上であればビットレートを下げる
+    public var highPacketLossRate: Double = 0.1
+    
+    // パケットロス率がこの値以下であればビットレートを上げる
+    public var lowPacketLossRate: Double = 0.02
+    
+    // RTT (秒) がこの値以上であればビットレートを下げる
+    public var highRoundTripTime: TimeInterval = 0.4
+    
+    // ビットレートを上げる (下げる) までに続けて必要な、上げられる (下げるべき) 標本の数
+    // 上げるほうを多くして、ビットレートが振動しないようにする
+    public var numberOfSamplesToIncrease: Int = 3
+    public var numberOfSamplesToDecrease: Int = 1
+    
+    // ビットレートを下げてからこの時間 (秒) はビットレートを上げない
+    public var holdTimeAfterDecrease: TimeInterval = 5
+    
+    // 統計を取得する間隔 (秒)
+    public var sampleInterval: TimeInterval = 1
+    
+    public init() {}
+    
+}
+
+// ビットレートの調整に使うネットワークの状態の標本
+public struct AdaptiveBitrateSample {
+    
+    // 標本を取得した時刻 (秒)
+    // 標本の間隔と、ビットレートを下げてからの時間の計算にのみ使う
+    public var time: TimeInterval
+    
+    // 前回の標本からのパケットロス率 (0 から 1)
+    public var packetLossRate: Double
+    
+    // RTT (秒)
+    public var roundTripTime: TimeInterval?
+    
+    // 帯域推定による送信可能なビットレート (kbps)
+    public var availableSendBitRate: Int?
+    
+    // 実際に送信しているビットレート (kbps)
+    public var sendBitRate: Int?
+    
+    public init(time: TimeInterval,
+                packetLossRate: Double,
+                roundTripTime: TimeInterval? = nil,
+                availableSendBitRate: Int? = nil,
+                sendBitRate: Int? = nil) {
+        self.time = time
+        self.packetLossRate = packetLossRate
+        self.roundTripTime = roundTripTime
+        self.availableSendBitRate = availableSendBitRate
+        self.sendBitRate = sendBitRate
+    }
+    
+}
+
+// ビットレートの調整の判断
+public struct AdaptiveBitrateDecision {
+    
+    public enum Action: String {
+        case increase
+        case decrease
+        case hold
+    }
+    
+    public var action: Action
+    public var previousBitRate: Int
+    public var bitRate: Int
+    
+    // 判断の理由 (ログ用)
+    public var reason: String
+    
+    public var sample: AdaptiveBitrateSample
+    
+}
+
+// ビットレートの調整の統計
+public struct AdaptiveBitrateStatistics {
+    
+    public var currentBitRate: Int = 0
+    public var numberOfSamples: Int = 0
+    public var numberOfIncreases: Int = 0
+    public var numberOfDecreases: Int = 0
+    
+    // 最新の標本
+    public var lastSample: AdaptiveBitrateSample?
+    
+    // ビットレートを変更した判断
+    // 最新の AdaptiveBitrateStatistics.maxNumberOfDecisions 件を保持する
+    public var decisions: [AdaptiveBitrateDecision] = []
+    
+    public static var maxNumberOfDecisions: Int = 100
+    
+}
+
+// パブリッシャーの映像の送信ビットレートを、ネットワークの状態に応じて調整する
+// StatsCollector が取得した送信の統計から、方針に従って RTCRtpSender の最大ビットレートを変更する
+// evaluate(_:) は接続がなくても使えるので、記録したネットワークの状態を与えて方針を調整できる
+// メインスレッドからのみ使うこと
+public class AdaptiveBitrateController {
+    
+    public var policy: AdaptiveBitratePolicy
+    
+    public var currentBitRate: Int {
+        get { return statistics.currentBitRate }
+    }
+    
+    public private(set) var statistics: AdaptiveBitrateStatistics =
+        AdaptiveBitrateStatistics()
+    
+    var consecutiveGoodSamples: Int = 0
+    var consecutiveBadSamples: Int = 0
+    var lastDecreaseTime: TimeInterval?
+    
+    // 他の調整 (PublishingQualityController) による最大ビットレートの制限
+    var maxBitRateLimit: Int?
+    
+    var onDecisionHandler: ((AdaptiveBitrateDecision) -> Void)?
+    
+    weak var context: PeerConnectionContext?
+    var isRunning: Bool = false
+    
+    public init(policy: AdaptiveBitratePolicy = AdaptiveBitratePolicy(),
+                initialBitRate: Int? = nil) {
+        self.policy = policy
+        statistics.currentBitRate = clamp(initialBitRate ?? policy.maxBitRate)
+    }
+    
+    // ビットレートを変更したときに呼ばれるハンドラ
+    public func onDecision(handler: @escaping (AdaptiveBitrateDecision) -> Void) {
+        onDecisionHandler = handler
+    }
+    
+    // MARK: 判断
+    
+    // 標本から次のビットレートを決める
+    @discardableResult
+    public func evaluate(_ sample: AdaptiveBitrateSample) -> AdaptiveBitrateDecision {
+        statistics.numberOfSamples += 1
+        statistics.lastSample = sample
+        
+        let current = statistics.currentBitRate
+        var decision = AdaptiveBitrateDecision(action: .hold,
+                                               previousBitRate: current,
+                                               bitRate: current,
+                                               reason: "stable",
+                                               sample: sample)
+        
+        var isCongested = false
+        if sample.packetLossRate >= policy.highPacketLossRate {
+            isCongested = true
+            decision.reason = String(format: "packet loss %.3f", sample.packetLossRate)
+        } else if let rtt = sample.roundTripTime, rtt >= policy.highRoundTripTime {
+            isCongested = true
+            decision.reason = String(format: "RTT %.3f", rtt)
+        }
+        
+        if isCongested {
+            consecutiveGoodSamples = 0
+            consecutiveBadSamples += 1
+            if consecutiveBadSamples >= policy.numberOfSamplesToDecrease {
+                consecutiveBadSamples = 0
+                var next = Int(Double(current) * (1 - policy.decreaseRate))
+                if let available = sample.availableSendBitRate {
+                    next = min(next, available)
+                }
+                decision.bitRate = clamp(next)
+                lastDecreaseTime = sample.time
+            }
+        } else if sample.packetLossRate <= policy.lowPacketLossRate {
+            consecutiveBadSamples = 0
+            consecutiveGoodSamples += 1
+            if let last = lastDecreaseTime,
+                sample.time - last < policy.holdTimeAfterDecrease {
+                decision.reason = "hold after decrease"
+            } else if consecutiveGoodSamples >= policy.numberOfSamplesToIncrease {
+                consecutiveGoodSamples = 0
+                var next = current + max(1, Int(Double(current) * policy.increaseRate))
+                if let available = sample.availableSendBitRate {
+                    // 帯域推定を超えては上げない
+                    next = max(current, min(next, available))
+                }
+                decision.bitRate = clamp(next)
+                decision.reason = String(format: "packet loss %.3f", sample.packetLossRate)
+            }
+        } else {
+            // 上げも下げもしない範囲では、続けた標本の数を数え直す
+            consecutiveGoodSamples = 0
+            consecutiveBadSamples = 0
+        }
+        
+        if decision.bitRate > current {
+            decision.action = .increase
+            statistics.numberOfIncreases += 1
+        } else if decision.bitRate < current {
+            decision.action = .decrease
+            statistics.numberOfDecreases += 1
+        }
+        
+        if decision.action != .hold {
+            statistics.currentBitRate = decision.bitRate
+            if statistics.decisions.count >= AdaptiveBitrateStatistics.maxNumberOfDecisions {
+                statistics.decisions.removeFirst()
+            }
+            statistics.decisions.append(decision)
+        }
+        return decision
+    }
+    
+    // 判断の状態と統計を初期化する
+    public func reset(initialBitRate: Int? = nil) {
+        statistics = AdaptiveBitrateStatistics()
+        statistics.currentBitRate = clamp(initialBitRate ?? policy.maxBitRate)
+        consecutiveGoodSamples = 0
+        consecutiveBadSamples = 0
+        lastDecreaseTime = nil
+    }
+    
+    func clamp(_ bitRate: Int) -> Int {
+        let maxBitRate = min(policy.maxBitRate, maxBitRateLimit ?? Int.max)
+        return max(policy.minBitRate, min(bitRate, maxBitRate))
+    }
+    
+    // 方針の最大ビットレートとは別に最大ビットレートを制限する
+    // 現在のビットレートが制限を超えていれば、すぐに下げる
+    func limit(maxBitRate: Int?) {
+        maxBitRateLimit = maxBitRate
+        let limited = clamp(currentBitRate)
+        if limited < currentBitRate {
+            context?.eventLog?.markFormat(type: .PeerConnection,
+                                          format: "adaptive bitrate: limit %d -> %d kbps",
+                                          arguments: currentBitRate, limited)
+            statistics.currentBitRate = limited
+            apply(bitRate: limited)
+        }
+    }
+    
+    // MARK: 統計の取得
+    
+    // PeerConnection の StatsCollector から統計を受け取る
+    // StatsCollector が動いていなければ、方針の間隔で開始する
+    func start(context: PeerConnectionContext) {
+        guard !isRunning else { return }
+        isRunning = true
+        self.context = context
+        context.eventLog?.markFormat(type: .PeerConnection,
+                                     format: "start adaptive bitrate (%d kbps)",
+                                     arguments: currentBitRate)
+        apply(bitRate: currentBitRate)
+        
+        let collector = context.statsCollector
+        if !collector.isRunning {
+            collector.interval = policy.sampleInterval
+        }
+        collector.addInternalUpdateHandler(key: .adaptiveBitrate) {
+            [weak self] collector in
+            self?.update(with: collector)
+        }
+        collector.start()
+    }
+    
+    func stop() {
+        guard isRunning else { return }
+        context?.eventLog?.markFormat(type: .PeerConnection,
+                                      format: "stop adaptive bitrate")
+        context?.statsCollector.removeInternalUpdateHandler(key: .adaptiveBitrate)
+        isRunning = false
+        context = nil
+    }
+    
+    // 映像の送信の統計と帯域推定から標本を作って判断する
+    func update(with collector: StatsCollector) {
+        guard isRunning else { return }
+        guard let stats = collector.latestStats(mediaType: "video",
+                                                direction: .send).first else
+        {
+            return
+        }
+        
+        var sample = AdaptiveBitrateSample(time: stats.timestamp,
+                                           packetLossRate: stats.packetLossRate,
+                                           roundTripTime: stats.roundTripTime)
+        if let bandwidth = collector.bandwidth {
+            sample.availableSendBitRate = bandwidth.availableSendBitRate.map { $0 / 1000 }
+            sample.sendBitRate = bandwidth.actualEncodedBitRate.map { $0 / 1000 }
+        }
+        
+        let decision = evaluate(sample)
+        if decision.action != .hold {
+            context?.eventLog?.markFormat(type: .PeerConnection,
+                                          format: "adaptive bitrate: %@ %d -> %d kbps (%@)",
+                                          arguments: decision.action.rawValue,
+                                          decision.previousBitRate,
+                                          decision.bitRate,
+                                          decision.reason)
+            apply(bitRate: decision.bitRate)
+            onDecisionHandler?(decision)
+        }
+    }
+    
+    func apply(bitRate: Int) {
+        guard let context = context else { return }
+        for sender in context.videoSenders {
+            let parameters = sender.parameters
+            for encoding in parameters.encodings {
+                encoding.maxBitrateBps = NSNumber(value: bitRate * 1000)
+            }
+            sender.parameters = parameters
+        }
+    }
+    
+}
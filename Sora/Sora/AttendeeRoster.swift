@@ -0,0 +1,213 @@
+import Foundation
+
+// 参加者の一覧の 1 人分
+public struct AttendeeRosterEntry {
+    
+    // 接続 ID (シグナリングに含まれなければクライアント ID)
+    public var connectionId: String
+    
+    public var clientId: String?
+    public var role: Role
+    
+    // 参加を通知された時刻
+    public var joinedTime: Date
+    
+}
+
+// 参加者の一覧の変更
+// 同じ実行ループの周回で受信した通知をまとめたもの
+public struct AttendeeRosterDiff {
+    
+    // 追加された参加者 (参加した順)
+    public var added: [AttendeeRosterEntry] = []
+    
+    // 削除された参加者
+    // 同じ周回で追加されてから削除された参加者は added と removed のどちらにも含まない
+    public var removed: [AttendeeRosterEntry] = []
+    
+    // まとめた通知の数
+    public var numberOfEvents: Int = 0
+    
+    // 最新の通知に含まれる接続数
+    public var numberOfPublishers: Int = 0
+    public var numberOfSubscribers: Int = 0
+    
+    public var isEmpty: Bool {
+        get { return added.isEmpty && removed.isEmpty }
+    }
+    
+}
+
+// 参加者の一覧のスナップショット
+// 一覧が変更されるまでは同じ配列を共有するので、何度取得しても安価である
+public struct AttendeeRosterSnapshot {
+    
+    // 参加した順の参加者
+    public var entries: [AttendeeRosterEntry]
+    
+    public var numberOfPublishers: Int
+    public var numberOfSubscribers: Int
+    
+    // 一覧が変更されるたびに増える
+    public var version: Int
+    
+}
+
+// シグナリングの "notify" から参加者の一覧を作る
+// 通知ごとに一覧を更新し、変更はメインスレッドで実行ループの 1 周回に 1 回だけ通知する
+// 接続 ID とクライアント ID のどちらも含まない通知では接続数のみを更新する
+// メインスレッドからのみ使うこと
+public class AttendeeRoster {
+    
+    public private(set) var numberOfPublishers: Int = 0
+    public private(set) var numberOfSubscribers: Int = 0
+    
+    // 変更された回数
+    public private(set) var version: Int = 0
+    
+    // 他の通知とまとめて変更を通知した (個別に通知しなかった) 通知の数
+    public private(set) var numberOfCoalescedEvents: Int = 0
+    
+    public var count: Int {
+        get { return entries.count }
+    }
+    
+    public var snapshot: AttendeeRosterSnapshot {
+        get {
+            if cachedEntries == nil {
+                compactOrder()
+                cachedEntries = order.flatMap { entries[$0] }
+            }
+            return AttendeeRosterSnapshot(entries: cachedEntries!,
+                                          numberOfPublishers: numberOfPublishers,
+                                          numberOfSubscribers: numberOfSubscribers,
+                                          version: version)
+        }
+    }
+    
+    // 接続 ID をキーとする参加者と、参加した順の接続 ID
+    // 削除した接続 ID は order に残しておき、
+    // スナップショットの生成時か、削除した数が多くなったときに取り除く
+    var entries: [String: AttendeeRosterEntry] = [:]
+    var order: [String] = []
+    var orderIndexes: [String: Int] = [:]
+    var cachedEntries: [AttendeeRosterEntry]?
+    
+    var pendingDiff: AttendeeRosterDiff = AttendeeRosterDiff()
+    var pendingAddedIds: Set<String> = []
+    var isFlushScheduled: Bool = false
+    
+    var onChangeHandler: ((AttendeeRosterDiff) -> Void)?
+    
+    init() {}
+    
+    public func entry(forConnectionId connectionId: String) -> AttendeeRosterEntry? {
+        return entries[connectionId]
+    }
+    
+    // 一覧の変更を受け取るハンドラ
+    public func onChange(handler: @escaping (AttendeeRosterDiff) -> Void) {
+        onChangeHandler = handler
+    }
+    
+    func apply(notify: SignalingNotify) {
+        numberOfPublishers = notify.numberOfPublishers
+        numberOfSubscribers = notify.numberOfSubscribers
+        pendingDiff.numberOfEvents += 1
+        pendingDiff.numberOfPublishers = notify.numberOfPublishers
+        pendingDiff.numberOfSubscribers = notify.numberOfSubscribers
+        
+        if let connectionId = notify.connectionId ?? notify.clientId {
+            switch notify.eventType {
+            case .connectionCreated:
+                add(AttendeeRosterEntry(connectionId: connectionId,
+                                        clientId: notify.clientId,
+                                        role: notify.role,
+                                        joinedTime: Date()))
+            case .connectionDestroyed:
+                remove(connectionId: connectionId)
+            default:
+                break
+            }
+        }
+        version += 1
+        scheduleFlush()
+    }
+    
+    func add(_ entry: AttendeeRosterEntry) {
+        guard entries[entry.connectionId] == nil else { return }
+        entries[entry.connectionId] = entry
+        orderIndexes[entry.connectionId] = order.count
+        order.append(entry.connectionId)
+        cachedEntries = nil
+        pendingDiff.added.append(entry)
+        pendingAddedIds.insert(entry.connectionId)
+    }
+    
+    func remove(connectionId: String) {
+        guard let entry = entries.removeValue(forKey: connectionId) else {
+            return
+        }
+        orderIndexes.removeValue(forKey: connectionId)
+        cachedEntries = nil
+        if pendingAddedIds.remove(connectionId) != nil {
+            // 未通知の追加を取り消す
+            if let index = pendingDiff.added.index(where: {
+                $0.connectionId == connectionId })
+            {
+                pendingDiff.added.remove(at: index)
+            }
+        } else {
+            pendingDiff.removed.append(entry)
+        }
+    }
+    
+    func removeAll() {
+        for id in order {
+            remove(connectionId: id)
+        }
+        order = []
+        orderIndexes = [:]
+        cachedEntries = nil
+        numberOfPublishers = 0
+        numberOfSubscribers = 0
+        version += 1
+        scheduleFlush()
+    }
+    
+    // 削除した接続 ID を order から取り除く
+    // 再び参加した接続 ID は最後の位置のみを残す
+    func compactOrder() {
+        guard order.count > entries.count else { return }
+        var compacted: [String] = []
+        compacted.reserveCapacity(entries.count)
+        for (index, id) in order.enumerated() {
+            if orderIndexes[id] == index {
+                orderIndexes[id] = compacted.count
+                compacted.append(id)
+            }
+        }
+        order = compacted
+    }
+    
+    func scheduleFlush() {
+        guard !isFlushScheduled else { return }
+        isFlushScheduled = true
+        DispatchQueue.main.async {
+            self.flush()
+        }
+    }
+    
+    func flush() {
+        isFlushScheduled = false
+        let diff = pendingDiff
+        pendingDiff = AttendeeRosterDiff()
+        pendingAddedIds = []
+        numberOfCoalescedEvents += max(0, diff.numberOfEvents - 1)
+        if order.count > max(16, entries.count * 2) {
+            compactOrder()
+        }
+        onChangeHandler?(diff)
+    }
+    
+}
@@ -103,6 +103,18 @@ public class Connection {
     public var mediaPublisher: MediaPublisher!
     public var mediaSubscriber: MediaSubscriber!
     
+    // 診断情報の記録
+    // isEnabled を true にすると、接続ごとに RTC イベントログなどを記録する
+    public var diagnosticsCapture: DiagnosticsCapture = DiagnosticsCapture()
+    
+    // ピア接続の生成に使うファクトリー
+    // 他の接続とスレッドを分けるには PeerConnectionFactoryProvider から別のファクトリーを取得して設定する
+    // WebRTC M57 ではファクトリーごとに音声デバイスモジュールを生成し、それぞれが音声セッションを設定する。
+    // 別のファクトリーを使う接続が同時に音声を送信すると、マイクと音声セッションを奪い合って正しく動作しない。
+    // 音声を送信する接続は同じファクトリーを使うこと
+    public var peerConnectionFactory: PeerConnectionFactory =
+        PeerConnectionFactoryProvider.shared.defaultFactory
+    
     public init(URL: Foundation.URL, mediaChannelId: String) {
         self.URL = URL
         self.mediaChannelId = mediaChannelId
@@ -0,0 +1,348 @@
+import Foundation
+
+// 接続の品質の段階
+public enum ConnectionQualityLevel: Int, Comparable {
+    
+    case critical
+    case poor
+    case fair
+    case good
+    case excellent
+    
+    public static func <(lhs: ConnectionQualityLevel,
+                         rhs: ConnectionQualityLevel) -> Bool {
+        return lhs.rawValue < rhs.rawValue
+    }
+    
+}
+
+// 接続の品質の推定に使う標本
+// 取得できない値は nil とし、品質の計算に含めない
+public struct ConnectionQualitySample {
+    
+    // RTT (秒)
+    public var roundTripTime: TimeInterval?
+    
+    // パケットロス率 (0 から 1)
+    public var packetLossRate: Double
+    
+    // 到着間隔の揺らぎ (秒)
+    public var jitter: TimeInterval?
+    
+    // 映像のフレームレートと、期待するフレームレート
+    public var frameRate: Double?
+    public var expectedFrameRate: Double?
+    
+    // 帯域推定による利用可能なビットレートと、必要なビットレート (bps)
+    public var availableBitRate: Double?
+    public var requiredBitRate: Double?
+    
+    public init(roundTripTime: TimeInterval? = nil,
+                packetLossRate: Double = 0,
+                jitter: TimeInterval? = nil,
+                frameRate: Double? = nil,
+                expectedFrameRate: Double? = nil,
+                availableBitRate: Double? = nil,
+                requiredBitRate: Double? = nil) {
+        self.roundTripTime = roundTripTime
+        self.packetLossRate = packetLossRate
+        self.jitter = jitter
+        self.frameRate = frameRate
+        self.expectedFrameRate = expectedFrameRate
+        self.availableBitRate = availableBitRate
+        self.requiredBitRate = requiredBitRate
+    }
+    
+}
+
+// 接続の品質の推定の方針
+public struct ConnectionQualityPolicy {
+    
+    // 各段階の下限のスコア
+    // どの下限にも届かなければ critical とする
+    public var lowerBounds: [ConnectionQualityLevel: Double] =
+        [.critical: 0, .poor: 20, .fair: 40, .good: 60, .excellent: 80]
+    
+    // 段階を変えるには、スコアが境界をこの値以上超える必要がある
+    public var hysteresis: Double = 5
+    
+    // 段階を変えるまでに続けて必要な標本の数
+    public var numberOfSamplesToChange: Int = 2
+    
+    // スコアの平滑化の係数 (0 から 1)
+    // 大きいほど新しい標本の影響が大きい
+    public var smoothingFactor: Double = 0.3
+    
+    // この値以下であれば満点、上限以上であれば 0 点とし、間は線形に補間する
+    public var goodRoundTripTime: TimeInterval = 0.15
+    public var badRoundTripTime: TimeInterval = 1.0
+    public var goodPacketLossRate: Double = 0.0
+    public var badPacketLossRate: Double = 0.15
+    public var goodJitter: TimeInterval = 0.03
+    public var badJitter: TimeInterval = 0.2
+    
+    // 各要素の重み
+    public var roundTripTimeWeight: Double = 1
+    public var packetLossWeight: Double = 2
+    public var jitterWeight: Double = 1
+    public var frameRateWeight: Double = 1
+    public var bandwidthWeight: Double = 1.5
+    
+    public init() {}
+    
+}
+
+// 接続の品質の段階の変化
+public struct ConnectionQualityChange {
+    
+    public var previousLevel: ConnectionQualityLevel
+    public var level: ConnectionQualityLevel
+    public var score: Double
+    
+}
+
+// RTT 、パケットロス、揺らぎ、フレームレート、利用可能な帯域から接続の品質のスコア (0 から 100) を推定する
+// スコアは指数移動平均で平滑化し、段階の変化にはヒステリシスを設けて、境界付近で段階が振動しないようにする
+// 標本 1 つあたりの計算量は一定であり、履歴を保持しない
+// メインスレッドからのみ使うこと
+public class ConnectionQualityEstimator {
+    
+    public var policy: ConnectionQualityPolicy
+    
+    // 平滑化したスコア
+    public private(set) var score: Double = 100
+    
+    public private(set) var level: ConnectionQualityLevel = .excellent
+    
+    public private(set) var numberOfSamples: Int = 0
+    
+    var pendingLevel: ConnectionQualityLevel?
+    var numberOfPendingSamples: Int = 0
+    
+    var onChangeHandler: ((ConnectionQualityChange) -> Void)?
+    
+    public init(policy: ConnectionQualityPolicy = ConnectionQualityPolicy()) {
+        self.policy = policy
+    }
+    
+    // 段階が変化したときに呼ばれるハンドラ
+    public func onChange(handler: @escaping (ConnectionQualityChange) -> Void) {
+        onChangeHandler = handler
+    }
+    
+    // 標本を与えてスコアを更新する
+    // 段階が変化すれば変化を返す
+    @discardableResult
+    public func update(_ sample: ConnectionQualitySample) -> ConnectionQualityChange? {
+        let raw = ConnectionQualityEstimator.score(of: sample, policy: policy)
+        if numberOfSamples == 0 {
+            score = raw
+        } else {
+            let alpha = max(0, min(1, policy.smoothingFactor))
+            score = alpha * raw + (1 - alpha) * score
+        }
+        numberOfSamples += 1
+        
+        let candidate = candidateLevel()
+        guard candidate != level else {
+            pendingLevel = nil
+            numberOfPendingSamples = 0
+            return nil
+        }
+        if candidate == pendingLevel {
+            numberOfPendingSamples += 1
+        } else {
+            pendingLevel = candidate
+            numberOfPendingSamples = 1
+        }
+        guard numberOfPendingSamples >= policy.numberOfSamplesToChange else {
+            return nil
+        }
+        
+        let change = ConnectionQualityChange(previousLevel: level,
+                                             level: candidate,
+                                             score: score)
+        level = candidate
+        pendingLevel = nil
+        numberOfPendingSamples = 0
+        onChangeHandler?(change)
+        return change
+    }
+    
+    public func reset() {
+        score = 100
+        level = .excellent
+        numberOfSamples = 0
+        pendingLevel = nil
+        numberOfPendingSamples = 0
+    }
+    
+    // ヒステリシスを考慮した、スコアに対応する段階
+    // 上げるには上の段階の下限 + hysteresis 以上、
+    // 下げるには現在の段階の下限 - hysteresis 未満のスコアが必要
+    func candidateLevel() -> ConnectionQualityLevel {
+        let up = qualityLevel(forScore: score - policy.hysteresis)
+        if up > level {
+            return up
+        }
+        let down = qualityLevel(forScore: score + policy.hysteresis)
+        if down < level {
+            return down
+        }
+        return level
+    }
+    
+    func qualityLevel(forScore score: Double) -> ConnectionQualityLevel {
+        var result: ConnectionQualityLevel = .critical
+        for level in [ConnectionQualityLevel.poor, .fair, .good, .excellent] {
+            if score >= policy.lowerBounds[level] ?? Double.infinity {
+                result = level
+            }
+        }
+        return result
+    }
+    
+    // 平滑化する前のスコア
+    // 取得できた要素の重み付き平均とする
+    static func score(of sample: ConnectionQualitySample,
+                      policy: ConnectionQualityPolicy) -> Double {
+        var total = 0.0
+        var weights = 0.0
+        
+        func add(_ value: Double, _ weight: Double) {
+            total += max(0, min(1, value)) * weight
+            weights += weight
+        }
+        
+        func linear(_ value: Double, good: Double, bad: Double) -> Double {
+            guard bad > good else { return value <= good ? 1 : 0 }
+            return 1 - (value - good) / (bad - good)
+        }
+        
+        add(linear(sample.packetLossRate,
+                   good: policy.goodPacketLossRate,
+                   bad: policy.badPacketLossRate),
+            policy.packetLossWeight)
+        if let rtt = sample.roundTripTime {
+            add(linear(rtt,
+                       good: policy.goodRoundTripTime,
+                       bad: policy.badRoundTripTime),
+                policy.roundTripTimeWeight)
+        }
+        if let jitter = sample.jitter {
+            add(linear(jitter, good: policy.goodJitter, bad: policy.badJitter),
+                policy.jitterWeight)
+        }
+        if let frameRate = sample.frameRate,
+            let expected = sample.expectedFrameRate, expected > 0 {
+            add(frameRate / expected, policy.frameRateWeight)
+        }
+        if let available = sample.availableBitRate,
+            let required = sample.requiredBitRate, required > 0 {
+            add(available / required, policy.bandwidthWeight)
+        }
+        
+        guard weights > 0 else { return 100 }
+        return total / weights * 100
+    }
+    
+}
+
+// MARK: - 統計からの推定
+
+extension ConnectionQualitySample {
+    
+    // StatsCollector の最新の統計から標本を作る
+    // パブリッシャーは送信、サブスクライバーは受信の統計を使う
+    init?(collector: StatsCollector, role: Role, expectedFrameRate: Double?) {
+        let direction: RTPStreamDirection = role == .publisher ? .send : .receive
+        let streams = collector.latestStats(direction: direction)
+        guard !streams.isEmpty else { return nil }
+        
+        self.init()
+        var video: RTPStreamStats?
+        var bitRate = 0.0
+        for stats in streams {
+            packetLossRate = max(packetLossRate, stats.packetLossRate)
+            if let rtt = stats.roundTripTime {
+                roundTripTime = max(roundTripTime ?? 0, rtt)
+            }
+            if let jitter = stats.jitter {
+                self.jitter = max(self.jitter ?? 0, jitter)
+            }
+            if stats.mediaType == "video" && video == nil {
+                video = stats
+            }
+            bitRate += stats.bitRate
+        }
+        
+        // 受信の統計には RTT が含まれないので、送信の統計があれば使う
+        if roundTripTime == nil {
+            for stats in collector.latestStats(direction: .send) {
+                if let rtt = stats.roundTripTime {
+                    roundTripTime = max(roundTripTime ?? 0, rtt)
+                }
+            }
+        }
+        
+        if let video = video {
+            frameRate = video.frameRate
+            self.expectedFrameRate = expectedFrameRate
+        }
+        
+        // 利用可能な帯域が送信 (受信) しているビットレートより少なければ品質を下げる
+        if let bandwidth = collector.bandwidth, bitRate > 0 {
+            let available = role == .publisher ?
+                bandwidth.availableSendBitRate : bandwidth.availableReceiveBitRate
+            if let available = available {
+                availableBitRate = Double(available)
+                requiredBitRate = bitRate
+            }
+        }
+    }
+    
+}
+
+extension PeerConnectionContext {
+    
+    // 統計を取得するたびに接続の品質を推定する
+    func startQualityEstimation() {
+        guard !isEstimatingQuality,
+            let mediaConnection = mediaConnection,
+            mediaConnection.qualityEstimationEnabled else { return }
+        isEstimatingQuality = true
+        eventLog?.markFormat(type: .PeerConnection,
+                             format: "start quality estimation")
+        
+        let estimator = mediaConnection.qualityEstimator
+        estimator.reset()
+        let role = self.role
+        statsCollector.addInternalUpdateHandler(key: .qualityEstimation) {
+            [weak self, weak mediaConnection] collector in
+            guard let weakSelf = self,
+                weakSelf.isEstimatingQuality,
+                let mediaConnection = mediaConnection else { return }
+            guard let sample = ConnectionQualitySample(
+                collector: collector,
+                role: role,
+                expectedFrameRate: mediaConnection.expectedFrameRate) else
+            {
+                return
+            }
+            if let change = estimator.update(sample) {
+                weakSelf.eventLog?.markFormat(type: .PeerConnection,
+                                              format: "connection quality: %@ -> %@ (score %.1f)",
+                                              arguments: String(describing: change.previousLevel),
+                                              String(describing: change.level),
+                                              change.score)
+            }
+        }
+        statsCollector.start()
+    }
+    
+    func stopQualityEstimation() {
+        isEstimatingQuality = false
+        statsCollector.removeInternalUpdateHandler(key: .qualityEstimation)
+    }
+    
+}
@@ -0,0 +1,383 @@
+import Foundation
+import QuartzCore
+import WebRTC
+
+// 診断情報の記録の設定
+public struct DiagnosticsCaptureOptions {
+    
+    // セッションごとのディレクトリを作るディレクトリ
+    public var directory: URL
+    
+    // RTC イベントログ (帯域推定やジッタバッファの解析用) を記録する
+    public var rtcEventLogEnabled: Bool = true
+    public var maxRtcEventLogSize: Int64 = 10 * 1024 * 1024
+    
+    // libwebrtc の内部のトレース (Chrome の trace event 形式) を記録する
+    // 負荷が高いので、必要なときのみ有効にすること
+    public var tracingEnabled: Bool = false
+    public var maxTraceSize: Int = 20 * 1024 * 1024
+    
+    // libwebrtc のログをファイルに記録する
+    public var fileLoggingEnabled: Bool = true
+    public var maxLogFileSize: UInt = 5 * 1024 * 1024
+    public var logSeverity: RTCFileLoggerSeverity = .info
+    
+    // EventLog の記録をファイルに書き出す
+    public var maxEventLogSize: Int = 1024 * 1024
+    
+    // 保持するセッションの数
+    // 新しいセッションを始めると、古いセッションのディレクトリを削除する
+    public var maxNumberOfSessions: Int = 5
+    
+    public init(directory: URL = DiagnosticsCaptureOptions.defaultDirectory) {
+        self.directory = directory
+    }
+    
+    public static var defaultDirectory: URL {
+        get {
+            let caches = FileManager.default.urls(for: .cachesDirectory,
+                                                  in: .userDomainMask).first!
+            return caches.appendingPathComponent("jp.shiguredo.Sora.diagnostics",
+                                                 isDirectory: true)
+        }
+    }
+    
+}
+
+// 診断情報を記録した 1 回分のセッション
+public struct DiagnosticsSession {
+    
+    public var directory: URL
+    public var startDate: Date
+    
+    // セッションの開始時の CACurrentMediaTime() の値
+    // RTC イベントログとトレースの時刻は単調増加の時計によるので、
+    // startDate との対応から EventLog の時刻と照合する
+    public var startMediaTime: CFTimeInterval
+    
+    // RTC イベントログ (接続ごと)、トレース、 libwebrtc のログ、 EventLog の記録
+    public var rtcEventLogURLs: [URL] {
+        get { return files(withExtension: "rtceventlog") }
+    }
+    
+    public var traceURL: URL {
+        get { return directory.appendingPathComponent("trace.json") }
+    }
+    
+    public var webRTCLogDirectory: URL {
+        get { return directory.appendingPathComponent("webrtc", isDirectory: true) }
+    }
+    
+    public var eventLogURL: URL {
+        get { return directory.appendingPathComponent("events.log") }
+    }
+    
+    public var infoURL: URL {
+        get { return directory.appendingPathComponent("session.json") }
+    }
+    
+    func files(withExtension ext: String) -> [URL] {
+        let contents = (try? FileManager.default
+            .contentsOfDirectory(at: directory,
+                                 includingPropertiesForKeys: nil)) ?? []
+        return contents.filter { $0.pathExtension == ext }
+            .sorted { $0.lastPathComponent < $1.lastPathComponent }
+    }
+    
+}
+
+// RTC イベントログ、 libwebrtc のトレースとログ、 EventLog の記録をセッションごとに保存する
+// 通話の品質が悪かったときに、帯域推定やジッタバッファの挙動を後から解析するために使う
+// isEnabled が true であれば、最初の接続でセッションを始め、すべての接続が終了したらセッションを終える
+// 接続中に start(eventLog:) を呼んでも、接続中のピア接続の RTC イベントログを記録する
+// トレースと libwebrtc のログはプロセスで 1 つなので、同時に 1 つのセッションのみ記録できる
+// メインスレッドからのみ使うこと
+public class DiagnosticsCapture {
+    
+    public var options: DiagnosticsCaptureOptions
+    
+    // 接続するたびに自動的にセッションを記録する
+    public var isEnabled: Bool = false
+    
+    public private(set) var currentSession: DiagnosticsSession?
+    
+    public var isCapturing: Bool {
+        get { return currentSession != nil }
+    }
+    
+    // 記録しているセッションが 1 つでもあれば、他の DiagnosticsCapture は記録できない
+    static var activeCapture: DiagnosticsCapture?
+    
+    static var isTracerSetUp: Bool = false
+    
+    static let queue: DispatchQueue =
+        DispatchQueue(label: "jp.shiguredo.Sora.diagnostics", qos: .utility)
+    
+    var fileLogger: RTCFileLogger?
+    var isTracing: Bool = false
+    var traceSizeTimer: Timer?
+    var eventLogHandle: FileHandle?
+    var eventLogSize: Int = 0
+    var attachedPeerConnections: [ObjectIdentifier: RTCPeerConnection] = [:]
+    
+    // 接続中のピア接続
+    // セッションを記録していなくても登録し、セッションを始めたときに RTC イベントログを記録する
+    var livePeerConnections: [ObjectIdentifier: (native: RTCPeerConnection, name: String)] = [:]
+    var numberOfAttachments: Int = 0
+    weak var eventLog: EventLog?
+    
+    public init(options: DiagnosticsCaptureOptions = DiagnosticsCaptureOptions()) {
+        self.options = options
+    }
+    
+    deinit {
+        stop()
+    }
+    
+    // MARK: セッション
+    
+    // 保存されているセッションの一覧 (古い順)
+    public func sessions() -> [URL] {
+        let contents = (try? FileManager.default
+            .contentsOfDirectory(at: options.directory,
+                                 includingPropertiesForKeys: [.isDirectoryKey])) ?? []
+        return contents.filter {
+            url in
+            let values = try? url.resourceValues(forKeys: [.isDirectoryKey])
+            return values?.isDirectory ?? false
+            }.sorted { $0.lastPathComponent < $1.lastPathComponent }
+    }
+    
+    // セッションを始める
+    // 既にセッションを記録していれば、そのセッションを返す
+    @discardableResult
+    public func start(eventLog: EventLog? = nil) -> DiagnosticsSession? {
+        if let session = currentSession {
+            return session
+        }
+        if let active = DiagnosticsCapture.activeCapture, active !== self {
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "diagnostics capture is busy")
+            return nil
+        }
+        
+        let now = Date()
+        let formatter = DateFormatter()
+        formatter.locale = Locale(identifier: "en_US_POSIX")
+        formatter.dateFormat = "yyyyMMdd-HHmmss-SSS"
+        let directory = options.directory
+            .appendingPathComponent(formatter.string(from: now), isDirectory: true)
+        let session = DiagnosticsSession(directory: directory,
+                                         startDate: now,
+                                         startMediaTime: CACurrentMediaTime())
+        do {
+            try FileManager.default.createDirectory(at: session.webRTCLogDirectory,
+                                                    withIntermediateDirectories: true,
+                                                    attributes: nil)
+        } catch {
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "cannot create diagnostics directory: %@",
+                                 arguments: error.localizedDescription)
+            return nil
+        }
+        rotateSessions()
+        
+        DiagnosticsCapture.activeCapture = self
+        currentSession = session
+        writeInfo(session)
+        
+        if options.fileLoggingEnabled {
+            let logger = RTCFileLogger(dirPath: session.webRTCLogDirectory.path,
+                                       maxFileSize: options.maxLogFileSize,
+                                       rotationType: .typeCall)
+            logger.severity = options.logSeverity
+            logger.start()
+            fileLogger = logger
+        }
+        
+        if options.tracingEnabled {
+            startTracing(session)
+        }
+        
+        FileManager.default.createFile(atPath: session.eventLogURL.path,
+                                       contents: nil,
+                                       attributes: nil)
+        eventLogHandle = try? FileHandle(forWritingTo: session.eventLogURL)
+        eventLogSize = 0
+        if let eventLog = eventLog {
+            self.eventLog = eventLog
+            eventLog.diagnosticsCapture = self
+            eventLog.markFormat(type: .PeerConnection,
+                                format: "start diagnostics capture: %@",
+                                arguments: directory.lastPathComponent)
+        }
+        
+        for (_, live) in livePeerConnections {
+            startRtcEventLog(live.native, name: live.name)
+        }
+        return session
+    }
+    
+    // セッションを終える
+    public func stop() {
+        guard currentSession != nil else { return }
+        eventLog?.markFormat(type: .PeerConnection,
+                             format: "stop diagnostics capture")
+        for (_, native) in attachedPeerConnections {
+            native.stopRtcEventLog()
+        }
+        attachedPeerConnections = [:]
+        stopTracing()
+        fileLogger?.stop()
+        fileLogger = nil
+        
+        if eventLog?.diagnosticsCapture === self {
+            eventLog?.diagnosticsCapture = nil
+        }
+        eventLog = nil
+        if let handle = eventLogHandle {
+            eventLogHandle = nil
+            DiagnosticsCapture.queue.async {
+                handle.closeFile()
+            }
+        }
+        
+        currentSession = nil
+        if DiagnosticsCapture.activeCapture === self {
+            DiagnosticsCapture.activeCapture = nil
+        }
+    }
+    
+    // 古いセッションのディレクトリを削除する
+    // 新しく作るセッションを含めて maxNumberOfSessions 個になるようにする
+    func rotateSessions() {
+        let all = sessions()
+        let excess = all.count - max(1, options.maxNumberOfSessions)
+        guard excess > 0 else { return }
+        for url in all.prefix(excess) {
+            try? FileManager.default.removeItem(at: url)
+        }
+    }
+    
+    func writeInfo(_ session: DiagnosticsSession) {
+        var info: [String: Any] = ["start_date": session.startDate.timeIntervalSince1970,
+                                   "start_media_time": session.startMediaTime]
+        if let version = BuildInfo.WebRTCVersion {
+            info["webrtc_version"] = version
+        }
+        if let revision = BuildInfo.WebRTCRevision {
+            info["webrtc_revision"] = revision
+        }
+        if let data = try? JSONSerialization.data(withJSONObject: info,
+                                                  options: [.prettyPrinted]) {
+            try? data.write(to: session.infoURL)
+        }
+    }
+    
+    // MARK: 接続
+    
+    // 接続を登録して、 RTC イベントログを記録する
+    // セッションを記録していなければ、 isEnabled が true のときのみセッションを始める
+    func attach(_ native: RTCPeerConnection, name: String, eventLog: EventLog?) {
+        livePeerConnections[ObjectIdentifier(native)] = (native, name)
+        if currentSession == nil {
+            guard isEnabled else { return }
+            start(eventLog: eventLog)
+        }
+        startRtcEventLog(native, name: name)
+    }
+    
+    func startRtcEventLog(_ native: RTCPeerConnection, name: String) {
+        guard let session = currentSession else { return }
+        let key = ObjectIdentifier(native)
+        guard attachedPeerConnections[key] == nil else { return }
+        attachedPeerConnections[key] = native
+        numberOfAttachments += 1
+        
+        if options.rtcEventLogEnabled {
+            let url = session.directory
+                .appendingPathComponent(String(format: "%02d-%@.rtceventlog",
+                                               numberOfAttachments, name))
+            if !native.startRtcEventLog(withFilePath: url.path,
+                                        maxSizeInBytes: options.maxRtcEventLogSize)
+            {
+                eventLog?.markFormat(type: .PeerConnection,
+                                     format: "cannot start RTC event log")
+            }
+        }
+    }
+    
+    // 接続の RTC イベントログの記録を終える
+    // isEnabled が true で、記録している接続がなくなればセッションを終える
+    func detach(_ native: RTCPeerConnection) {
+        let key = ObjectIdentifier(native)
+        livePeerConnections.removeValue(forKey: key)
+        guard attachedPeerConnections.removeValue(forKey: key) != nil else {
+            return
+        }
+        native.stopRtcEventLog()
+        if isEnabled && attachedPeerConnections.isEmpty {
+            stop()
+        }
+    }
+    
+    // MARK: トレース
+    
+    func startTracing(_ session: DiagnosticsSession) {
+        if !DiagnosticsCapture.isTracerSetUp {
+            RTCSetupInternalTracer()
+            DiagnosticsCapture.isTracerSetUp = true
+        }
+        guard RTCStartInternalCapture(session.traceURL.path) else {
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "cannot start internal tracing")
+            return
+        }
+        isTracing = true
+        
+        // トレースの API には大きさの上限がないので、定期的に大きさを確認する
+        let maxSize = options.maxTraceSize
+        traceSizeTimer = Timer(timeInterval: 5, repeats: true) {
+            [weak self] _ in
+            let attrs = try? FileManager.default
+                .attributesOfItem(atPath: session.traceURL.path)
+            if let size = attrs?[.size] as? Int, size >= maxSize {
+                self?.eventLog?.markFormat(type: .PeerConnection,
+                                           format: "trace reached size limit")
+                self?.stopTracing()
+            }
+        }
+        RunLoop.main.add(traceSizeTimer!, forMode: .commonModes)
+    }
+    
+    func stopTracing() {
+        traceSizeTimer?.invalidate()
+        traceSizeTimer = nil
+        if isTracing {
+            RTCStopInternalCapture()
+            isTracing = false
+        }
+    }
+    
+    // MARK: EventLog
+    
+    // EventLog の記録をファイルに書き出す
+    // 時刻はセッションの開始からの秒数と UNIX 時刻の両方を書く
+    func write(event: Event) {
+        guard let handle = eventLogHandle,
+            let session = currentSession else { return }
+        let elapsed = event.date.timeIntervalSince(session.startDate)
+        let line = String(format: "%.6f\t%.3f\t%@\t%@\n",
+                          event.date.timeIntervalSince1970,
+                          elapsed,
+                          event.type.rawValue,
+                          event.comment)
+        guard let data = line.data(using: .utf8) else { return }
+        guard eventLogSize + data.count <= options.maxEventLogSize else { return }
+        eventLogSize += data.count
+        DiagnosticsCapture.queue.async {
+            handle.write(data)
+        }
+    }
+    
+}
@@ -85,6 +85,7 @@ public class EventLog {
                 }
             }
             events.append(event)
+            diagnosticsCapture?.write(event: event)
             onMarkHandler?(event)
         }
     }
@@ -100,6 +101,9 @@ public class EventLog {
     
     var onMarkHandler: ((Event) -> Void)?
     
+    // 記録をファイルに書き出す DiagnosticsCapture
+    weak var diagnosticsCapture: DiagnosticsCapture?
+    
     public func onMark(handler: @escaping (Event) -> Void) {
         onMarkHandler = handler
     }
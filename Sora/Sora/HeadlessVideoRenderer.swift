@@ -0,0 +1,294 @@
+import Foundation
+import CoreMedia
+import QuartzCore
+import WebRTC
+
+// 画面に描画しない映像レンダラー
+// キーウィンドウや RTCEAGLVideoView を必要としないので、
+// UI のないテストやベンチマークでフレームの配信を計測できる
+// VideoView と同様に MediaStream.videoRenderer にセットして使う
+// いずれのメソッドもメインスレッドから呼ばれる
+
+// 受け取ったフレームを数える
+public class CountingVideoRenderer: VideoRenderer {
+    
+    // 受け取ったフレームの数 (nil を除く)
+    public private(set) var numberOfFrames: Int = 0
+    
+    // nil のフレームを受け取った回数
+    public private(set) var numberOfNilFrames: Int = 0
+    
+    // 受け取ったスナップショットの数
+    public private(set) var numberOfSnapshots: Int = 0
+    
+    // タイムスタンプが直前のフレーム以前だったフレームの数
+    public private(set) var numberOfOutOfOrderFrames: Int = 0
+    
+    // サイズの変更の通知を受けた回数
+    public private(set) var numberOfSizeChanges: Int = 0
+    
+    public private(set) var lastFrameSize: CGSize?
+    public private(set) var lastTimestamp: CMTime?
+    
+    // 最初と最後のフレームを受け取った時刻
+    public private(set) var firstFrameTime: CFTimeInterval?
+    public private(set) var lastFrameTime: CFTimeInterval?
+    
+    // フレームのタイムスタンプから受け取るまでの時間の合計と最大 (秒)
+    // WebRTC のタイムスタンプは CACurrentMediaTime() と同じ単調増加の時計を基準にする
+    public private(set) var totalDeliveryLatency: Double = 0
+    public private(set) var maxDeliveryLatency: Double = 0
+    
+    public var averageDeliveryLatency: Double {
+        get {
+            guard numberOfFrames > 0 else { return 0 }
+            return totalDeliveryLatency / Double(numberOfFrames)
+        }
+    }
+    
+    // 最初のフレームから最後のフレームまでのフレームレート
+    public var framesPerSecond: Double {
+        get {
+            guard let first = firstFrameTime, let last = lastFrameTime,
+                last > first else { return 0 }
+            return Double(numberOfFrames - 1) / (last - first)
+        }
+    }
+    
+    public init() {}
+    
+    public func reset() {
+        numberOfFrames = 0
+        numberOfNilFrames = 0
+        numberOfSnapshots = 0
+        numberOfOutOfOrderFrames = 0
+        numberOfSizeChanges = 0
+        lastFrameSize = nil
+        lastTimestamp = nil
+        firstFrameTime = nil
+        lastFrameTime = nil
+        totalDeliveryLatency = 0
+        maxDeliveryLatency = 0
+    }
+    
+    public func onChangedSize(_ size: CGSize) {
+        numberOfSizeChanges += 1
+    }
+    
+    public func render(videoFrame: VideoFrame?) {
+        guard let frame = videoFrame else {
+            numberOfNilFrames += 1
+            return
+        }
+        
+        let now = CACurrentMediaTime()
+        numberOfFrames += 1
+        if firstFrameTime == nil {
+            firstFrameTime = now
+        }
+        lastFrameTime = now
+        lastFrameSize = CGSize(width: frame.width, height: frame.height)
+        
+        if let last = lastTimestamp {
+            if CMTimeCompare(frame.timestamp, last) <= 0 {
+                numberOfOutOfOrderFrames += 1
+            }
+        }
+        lastTimestamp = frame.timestamp
+        
+        if frame.timestamp.isValid {
+            let latency = max(0, now - CMTimeGetSeconds(frame.timestamp))
+            totalDeliveryLatency += latency
+            maxDeliveryLatency = max(maxDeliveryLatency, latency)
+        }
+        
+        process(videoFrame: frame)
+    }
+    
+    public func render(snapshot: Snapshot) {
+        numberOfSnapshots += 1
+    }
+    
+    // サブクラスでフレームを処理する
+    func process(videoFrame: VideoFrame) {}
+    
+}
+
+// 受け取ったフレームの画素のハッシュ値を計算する
+// 映像の符号化は非可逆なので、送信側のフレームと受信側のフレームのハッシュ値は一致しない。
+// 同じ側で得たハッシュ値どうしを比較する用途に使う
+// (同じ映像を復号した結果が毎回同じになるかの確認や、記録しておいた基準値との回帰テストなど)
+public class ChecksumVideoRenderer: CountingVideoRenderer {
+    
+    // 最大でいくつのハッシュ値を保持するか
+    // 超えたら古いものから捨てる
+    public var limit: Int = 10000 {
+        didSet {
+            buffer = Array(checksums.suffix(max(1, limit)))
+            head = 0
+        }
+    }
+    
+    // フレームのタイムスタンプとハッシュ値 (FNV-1a 64 ビット) の古い順の一覧
+    public var checksums: [(CMTime, UInt64)] {
+        get { return Array(buffer[head..<buffer.count]) + Array(buffer[0..<head]) }
+    }
+    
+    var buffer: [(CMTime, UInt64)] = []
+    
+    // 最も古いハッシュ値の位置 (バッファが一杯になってから使う)
+    var head: Int = 0
+    
+    public override func reset() {
+        super.reset()
+        buffer = []
+        head = 0
+    }
+    
+    override func process(videoFrame: VideoFrame) {
+        guard let hash = ChecksumVideoRenderer.checksum(of: videoFrame) else {
+            return
+        }
+        let entry = (videoFrame.timestamp, hash)
+        if buffer.count < max(1, limit) {
+            buffer.append(entry)
+        } else {
+            buffer[head] = entry
+            head = (head + 1) % buffer.count
+        }
+    }
+    
+    // I420 と NV12 のどちらのフレームも、同じ画素であれば同じハッシュ値になる
+    static func checksum(of videoFrame: VideoFrame) -> UInt64? {
+        return videoFrame.withPlanes {
+            (planes: VideoFramePlanes) -> UInt64 in
+            var hash: UInt64 = 0xcbf29ce484222325
+            hash = fnv1a(hash, planes.yPlane, planes.width, planes.height,
+                         planes.yStride, 1)
+            hash = fnv1a(hash, planes.uPlane, planes.chromaWidth, planes.chromaHeight,
+                         planes.uStride, planes.chromaPixelStride)
+            hash = fnv1a(hash, planes.vPlane, planes.chromaWidth, planes.chromaHeight,
+                         planes.vStride, planes.chromaPixelStride)
+            return hash
+        }
+    }
+    
+    // パディングを除いた画素のみを対象にする
+    static func fnv1a(_ seed: UInt64,
+                      _ plane: UnsafePointer<UInt8>,
+                      _ width: Int, _ height: Int,
+                      _ stride: Int, _ pixelStride: Int) -> UInt64 {
+        var hash = seed
+        for row in 0..<height {
+            let p = plane + row * stride
+            for col in 0..<width {
+                hash = (hash ^ UInt64(p[col * pixelStride])) &* 0x100000001b3
+            }
+        }
+        return hash
+    }
+    
+}
+
+// 受け取ったフレームを Y4M (YUV4MPEG2) 形式でファイルに書き出す
+// Y4M は途中で解像度を変更できないので、
+// 最初のフレームと解像度が異なるフレームは書き出さずに数える
+public class Y4MFileVideoRenderer: CountingVideoRenderer {
+    
+    public var fileURL: URL
+    
+    // ヘッダーに書き出すフレームレート
+    public var frameRate: Int = 30
+    
+    // 書き出したフレームの数
+    public private(set) var numberOfWrittenFrames: Int = 0
+    
+    // 解像度が異なるために書き出さなかったフレームの数
+    public private(set) var numberOfSkippedFrames: Int = 0
+    
+    var fileHandle: FileHandle?
+    var frameSize: (Int, Int)?
+    
+    public init(fileURL: URL) {
+        self.fileURL = fileURL
+    }
+    
+    deinit {
+        close()
+    }
+    
+    public func close() {
+        fileHandle?.closeFile()
+        fileHandle = nil
+    }
+    
+    override func process(videoFrame: VideoFrame) {
+        _ = videoFrame.withPlanes { planes in
+            write(planes: planes)
+        }
+    }
+    
+    func write(planes: VideoFramePlanes) {
+        if let size = frameSize {
+            guard size.0 == planes.width && size.1 == planes.height else {
+                numberOfSkippedFrames += 1
+                return
+            }
+        } else {
+            guard openFile(width: planes.width, height: planes.height) else {
+                return
+            }
+        }
+        
+        var data = "FRAME\n".data(using: .ascii)!
+        append(&data, planes.yPlane, planes.width, planes.height,
+               planes.yStride, 1)
+        append(&data, planes.uPlane, planes.chromaWidth, planes.chromaHeight,
+               planes.uStride, planes.chromaPixelStride)
+        append(&data, planes.vPlane, planes.chromaWidth, planes.chromaHeight,
+               planes.vStride, planes.chromaPixelStride)
+        fileHandle?.write(data)
+        numberOfWrittenFrames += 1
+    }
+    
+    func openFile(width: Int, height: Int) -> Bool {
+        let manager = FileManager.default
+        if !manager.createFile(atPath: fileURL.path, contents: nil,
+                               attributes: nil) {
+            return false
+        }
+        guard let handle = try? FileHandle(forWritingTo: fileURL) else {
+            return false
+        }
+        let header = String(format: "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                            width, height, frameRate)
+        handle.write(header.data(using: .ascii)!)
+        fileHandle = handle
+        frameSize = (width, height)
+        return true
+    }
+    
+    // パディングを除いて行ごとに追加する
+    // NV12 の色差は 1 画素ずつ取り出して I420 と同じ並びにする
+    func append(_ data: inout Data,
+                _ plane: UnsafePointer<UInt8>,
+                _ width: Int, _ height: Int,
+                _ stride: Int, _ pixelStride: Int) {
+        guard pixelStride > 1 else {
+            for row in 0..<height {
+                data.append(plane + row * stride, count: width)
+            }
+            return
+        }
+        
+        var rowData = [UInt8](repeating: 0, count: width)
+        for row in 0..<height {
+            let p = plane + row * stride
+            for col in 0..<width {
+                rowData[col] = p[col * pixelStride]
+            }
+            data.append(rowData, count: width)
+        }
+    }
+    
+}
@@ -0,0 +1,156 @@
+import Foundation
+import WebRTC
+
+// キャプチャーを共有する単位
+// ファクトリーとキャプチャーの制約の値が同じであれば同じキャプチャーを使う
+struct MediaCapturerKey: Hashable {
+    
+    let factory: ObjectIdentifier
+    let constraints: String
+    
+    // 値を取得できない制約のオブジェクト
+    // 制約はオブジェクトで区別するので、プールにある間に解放されて
+    // 同じアドレスの別の制約と取り違えないように保持する
+    let opaqueConstraints: RTCMediaConstraints?
+    
+    init(factory: RTCPeerConnectionFactory, mediaOption: MediaOption?) {
+        let mediaOption = mediaOption ?? MediaOption()
+        self.factory = ObjectIdentifier(factory)
+        constraints = mediaOption.videoCaptureSourceConstraintsKey
+        opaqueConstraints = mediaOption.hasOpaqueVideoCaptureSourceConstraints ?
+            mediaOption.videoCaptureSourceMediaConstraints : nil
+    }
+    
+    var hashValue: Int {
+        get { return factory.hashValue ^ constraints.hashValue }
+    }
+    
+    static func ==(lhs: MediaCapturerKey, rhs: MediaCapturerKey) -> Bool {
+        return lhs.factory == rhs.factory && lhs.constraints == rhs.constraints &&
+            lhs.opaqueConstraints === rhs.opaqueConstraints
+    }
+    
+}
+
+// キャプチャーの参照の数を数えて共有するプール
+// 同じファクトリーに対してキャプチャーを何度も生成すると落ちる可能性があるので、
+// 使われなくなったキャプチャーはすぐに解放せず、 idleTimeout の間はプールに残して再接続で使う
+// スレッドセーフであり、どのスレッドからでも利用できる
+public final class MediaCapturerPool {
+    
+    public static let shared: MediaCapturerPool = MediaCapturerPool()
+    
+    // 使われなくなったキャプチャーをプールに残す時間 (秒)
+    // nil であれば解放しない
+    public var idleTimeout: TimeInterval? = 60
+    
+    // 使用中のキャプチャーの数
+    public var numberOfLiveCapturers: Int {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return entries.values.filter { $0.referenceCount > 0 }.count
+        }
+    }
+    
+    // 使われずにプールに残っているキャプチャーの数
+    public var numberOfPooledCapturers: Int {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return entries.values.filter { $0.referenceCount == 0 }.count
+        }
+    }
+    
+    final class Entry {
+        
+        let capturer: MediaCapturer
+        var referenceCount: Int = 0
+        var idleSince: Date?
+        
+        init(capturer: MediaCapturer) {
+            self.capturer = capturer
+        }
+        
+    }
+    
+    let lock: NSLock = NSLock()
+    var entries: [MediaCapturerKey: Entry] = [:]
+    
+    init() {}
+    
+    // キャプチャーを取得して参照の数を増やす
+    // プールにあれば再利用し、なければ生成する
+    // 再利用したかどうかも返す
+    func acquire(factory: RTCPeerConnectionFactory,
+                 mediaOption: MediaOption?) -> (capturer: MediaCapturer, isReused: Bool) {
+        let key = MediaCapturerKey(factory: factory, mediaOption: mediaOption)
+        lock.lock()
+        defer { lock.unlock() }
+        if let entry = entries[key] {
+            entry.referenceCount += 1
+            entry.idleSince = nil
+            return (entry.capturer, true)
+        }
+        let entry = Entry(capturer: MediaCapturer(factory: factory,
+                                                  mediaOption: mediaOption))
+        entry.referenceCount = 1
+        entries[key] = entry
+        return (entry.capturer, false)
+    }
+    
+    // 参照の数を減らす
+    // 使われなくなったら idleTimeout の後に解放する
+    func release(_ capturer: MediaCapturer) {
+        lock.lock()
+        guard let entry = entries.values.first(where: { $0.capturer === capturer }) else {
+            lock.unlock()
+            return
+        }
+        entry.referenceCount = max(0, entry.referenceCount - 1)
+        let timeout = idleTimeout
+        let isIdle = entry.referenceCount == 0
+        if isIdle {
+            entry.idleSince = Date()
+        }
+        lock.unlock()
+        
+        if isIdle, let timeout = timeout {
+            DispatchQueue.main.asyncAfter(deadline: .now() + timeout) {
+                [weak self] in
+                self?.evictIdleCapturers(olderThan: timeout)
+            }
+        }
+    }
+    
+    // 使われずにプールに残っているキャプチャーをすべて解放する
+    public func evictAll() {
+        evictIdleCapturers(olderThan: 0)
+    }
+    
+    // ファクトリーの終了時に、そのファクトリーのキャプチャーを解放する
+    func evictIdleCapturers(for factory: RTCPeerConnectionFactory) {
+        let id = ObjectIdentifier(factory)
+        lock.lock()
+        defer { lock.unlock() }
+        for (key, entry) in entries {
+            if key.factory == id && entry.referenceCount == 0 {
+                entries.removeValue(forKey: key)
+            }
+        }
+    }
+    
+    func evictIdleCapturers(olderThan timeout: TimeInterval) {
+        lock.lock()
+        defer { lock.unlock() }
+        let now = Date()
+        for (key, entry) in entries {
+            if entry.referenceCount == 0,
+                let idleSince = entry.idleSince,
+                now.timeIntervalSince(idleSince) >= timeout {
+                entries.removeValue(forKey: key)
+            }
+        }
+    }
+    
+}
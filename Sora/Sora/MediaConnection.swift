@@ -35,11 +35,41 @@ public class MediaConnection {
     public var mediaOption: MediaOption = MediaOption()
     public var multistreamEnabled: Bool = false
     public var snapshotEnabled: Bool = false
-    public var mediaStreams: [MediaStream] = []
+    
+    // スナップショットを段階的にデコードし、途中経過も描画する
+    public var incrementalSnapshotEnabled: Bool = false
+    
+    // 段階的なデコードで一度にデコードする Base64 文字列の長さ
+    public var incrementalSnapshotChunkSize: Int = 16 * 1024
+    
+    // 追加された順のメディアストリーム
+    public var mediaStreams: [MediaStream] {
+        get { return mediaStreamRegistry.streams }
+    }
     
     public var mainMediaStream: MediaStream? {
-        get { return mediaStreams.first }
+        get { return mediaStreamRegistry.first }
     }
+    
+    var mediaStreamRegistry: MediaStreamRegistry = MediaStreamRegistry()
+    
+    // シグナリングの "notify" から作る参加者の一覧
+    public let attendeeRoster: AttendeeRoster = AttendeeRoster()
+    
+    // 接続の品質の推定
+    // qualityEstimationEnabled が true であれば、接続中に統計から品質を推定する
+    public let qualityEstimator: ConnectionQualityEstimator = ConnectionQualityEstimator()
+    public var qualityEstimationEnabled: Bool = false
+    
+    // 品質の推定で期待する映像のフレームレート
+    // nil であればフレームレートを品質の推定に使わない
+    public var expectedFrameRate: Double? = 30
+    
+    // 帯域不足が続いたときに映像の送信を止めて音声のみにする
+    // videoFallbackEnabled が true であれば、接続中に統計から判断する
+    // パブリッシャーのみ有効
+    public let videoFallbackController: VideoFallbackController = VideoFallbackController()
+    public var videoFallbackEnabled: Bool = false
 
     public var webSocketEventHandlers: WebSocketEventHandlers
         = WebSocketEventHandlers()
@@ -130,10 +160,10 @@ public class MediaConnection {
             handler(ConnectionError.connectionBusy)
         case .connected?, .connecting?:
             eventLog?.markFormat(type: eventType, format: "disconnect ok")
-            for stream in mediaStreams {
+            for stream in mediaStreamRegistry.removeAll() {
                 stream.terminate()
             }
-            mediaStreams = []
+            attendeeRoster.removeAll()
             peerConnection!.disconnect {
                 error in
                 handler(error)
@@ -152,20 +182,22 @@ public class MediaConnection {
     
     // MARK: マルチストリーム
     
+    // ストリーム ID に一致するメディアストリームを返す
+    public func mediaStream(forId mediaStreamId: String) -> MediaStream? {
+        return mediaStreamRegistry.stream(forId: mediaStreamId)
+    }
+    
     func hasMediaStream(_ mediaStreamId: String) -> Bool {
         guard let peerConn = peerConnection else {
             assertionFailure("peer connection must not be nil")
             return false
         }
         
-        if multistreamEnabled && !mediaStreams.isEmpty &&
+        if multistreamEnabled && !mediaStreamRegistry.isEmpty &&
             peerConn.clientId == mediaStreamId {
             return true
         } else {
-            return mediaStreams.contains {
-                stream in
-                return stream.mediaStreamId == mediaStreamId
-            }
+            return mediaStreamRegistry.contains(mediaStreamId)
         }
     }
     
@@ -177,23 +209,13 @@ public class MediaConnection {
             assertionFailure("media stream already exists")
         }
         
-        mediaStreams.append(mediaStream)
+        mediaStreamRegistry.insert(mediaStream)
         onAddStreamHandler?(mediaStream)
     }
     
     func removeMediaStream(_ mediaStreamId: String) {
         eventLog?.markFormat(type: eventType, format: "remove media stream")
-        var removed: MediaStream?
-        mediaStreams = mediaStreams.filter {
-            e in
-            if e.mediaStreamId == mediaStreamId {
-                removed = e
-                return false
-            } else {
-                return true
-            }
-        }
-        if let stream = removed {
+        if let stream = mediaStreamRegistry.remove(forId: mediaStreamId) {
             onRemoveStreamHandler?(stream)
         }
     }
@@ -206,6 +228,15 @@ public class MediaConnection {
         mainMediaStream?.videoRenderer?.render(snapshot: snapshot)
     }
     
+    // 段階的なデコードの途中経過を描画する
+    // スナップショットのイベントハンドラは呼ばない
+    func render(partialSnapshot: Snapshot) {
+        eventLog?.markFormat(type: .Snapshot,
+                             format: "render partial snapshot (%d rows)",
+                             arguments: partialSnapshot.numberOfDecodedRows)
+        mainMediaStream?.videoRenderer?.render(snapshot: partialSnapshot)
+    }
+    
     // MARK: イベントハンドラ
     
     private var onConnectHandler: ((ConnectionError?) -> Void)?
@@ -303,24 +334,92 @@ public class MediaConnection {
     
 }
 
+// 映像のキャプチャー
+// 生成するとカメラのキャプチャーセッションが準備される
+final class VideoCapturerPart {
+    
+    let source: RTCAVFoundationVideoSource
+    let track: RTCVideoTrack
+    
+    init(factory: RTCPeerConnectionFactory,
+         constraints: RTCMediaConstraints,
+         trackId: String) {
+        source = factory.avFoundationVideoSource(with: constraints)
+        track = factory.videoTrack(with: source, trackId: trackId)
+    }
+    
+}
+
+// 音声のキャプチャー
+final class AudioCapturerPart {
+    
+    let track: RTCAudioTrack
+    
+    init(factory: RTCPeerConnectionFactory, trackId: String) {
+        track = factory.audioTrack(withTrackId: trackId)
+    }
+    
+}
+
+// 映像と音声のキャプチャー
+// 映像と音声はそれぞれ必要になったときに生成する
+// 音声のみで接続すれば、映像のキャプチャー (AVFoundation) は生成しない
 class MediaCapturer {
     
-    public var videoCaptureTrack: RTCVideoTrack
-    public var videoCaptureSource: RTCAVFoundationVideoSource
-    public var audioCaptureTrack: RTCAudioTrack
+    let factory: RTCPeerConnectionFactory
+    let videoCaptureSourceMediaConstraints: RTCMediaConstraints
+    let videoCaptureTrackId: String
+    let audioCaptureTrackId: String
+    
+    private(set) var video: VideoCapturerPart?
+    private(set) var audio: AudioCapturerPart?
+    
+    // 生成していなければ nil
+    var videoCaptureTrack: RTCVideoTrack? {
+        get { return video?.track }
+    }
+    
+    var videoCaptureSource: RTCAVFoundationVideoSource? {
+        get { return video?.source }
+    }
+    
+    var audioCaptureTrack: RTCAudioTrack? {
+        get { return audio?.track }
+    }
     
     init(factory: RTCPeerConnectionFactory, mediaOption: MediaOption?) {
-        videoCaptureSource = factory
-            .avFoundationVideoSource(with:
-                mediaOption?.videoCaptureSourceMediaConstraints ??
-                    MediaOption.defaultMediaConstraints)
-        videoCaptureTrack = factory
-            .videoTrack(with: videoCaptureSource,
-                        trackId: mediaOption?.videoCaptureTrackId ??
-                            MediaOption.createCaptureTrackId())
-        audioCaptureTrack = factory
-            .audioTrack(withTrackId: mediaOption?.audioCaptureTrackId ??
-                MediaOption.createCaptureTrackId())
+        self.factory = factory
+        videoCaptureSourceMediaConstraints =
+            mediaOption?.videoCaptureSourceMediaConstraints ??
+                MediaOption.defaultMediaConstraints
+        videoCaptureTrackId = mediaOption?.videoCaptureTrackId ??
+            MediaOption.createCaptureTrackId()
+        audioCaptureTrackId = mediaOption?.audioCaptureTrackId ??
+            MediaOption.createCaptureTrackId()
+    }
+    
+    // 映像のキャプチャーを返す
+    // 生成していなければ生成する
+    func videoPart() -> VideoCapturerPart {
+        if let video = video {
+            return video
+        }
+        let part = VideoCapturerPart(factory: factory,
+                                     constraints: videoCaptureSourceMediaConstraints,
+                                     trackId: videoCaptureTrackId)
+        video = part
+        return part
+    }
+    
+    // 音声のキャプチャーを返す
+    // 生成していなければ生成する
+    func audioPart() -> AudioCapturerPart {
+        if let audio = audio {
+            return audio
+        }
+        let part = AudioCapturerPart(factory: factory, trackId: audioCaptureTrackId)
+        audio = part
+        return part
     }
     
 }
@@ -341,11 +440,11 @@ public enum CameraPosition: String {
 public class MediaPublisher: MediaConnection {
     
     public var canUseBackCamera: Bool? {
-        get { return mediaCapturer?.videoCaptureSource.canUseBackCamera }
+        get { return mediaCapturer?.videoCaptureSource?.canUseBackCamera }
     }
     
     public var captureSession: AVCaptureSession? {
-        get { return mediaCapturer?.videoCaptureSource.captureSession }
+        get { return mediaCapturer?.videoCaptureSource?.captureSession }
     }
 
     var _cameraPosition: CameraPosition?
@@ -353,7 +452,7 @@ public class MediaPublisher: MediaConnection {
     public var cameraPosition: CameraPosition? {
         
         get {
-            if mediaCapturer != nil {
+            if mediaCapturer?.video != nil {
                 if _cameraPosition == nil {
                     _cameraPosition = .front
                 }
@@ -364,24 +463,40 @@ public class MediaPublisher: MediaConnection {
         }
         
         set {
-            if let capturer = mediaCapturer {
+            if let source = mediaCapturer?.videoCaptureSource {
                 if let value = newValue {
                     eventLog?.markFormat(type: eventType,
                                          format: "switch camera to %@",
                                          arguments: value.rawValue)
                     switch value {
                     case .front:
-                        capturer.videoCaptureSource.useBackCamera = false
+                        source.useBackCamera = false
                     case .back:
-                        capturer.videoCaptureSource.useBackCamera = true
+                        source.useBackCamera = true
                     }
                     _cameraPosition = newValue
+                    
+                    // 切り替え後のカメラにも指定を適用する
+                    applyVideoCaptureSettings()
                 }
             }
         }
         
     }
     
+    // キャプチャーの解像度とフレームレート
+    // 接続中に変更でき、再ネゴシエーションせずにカメラに適用する
+    // nil にしても元の設定には戻らない
+    public var videoCaptureSettings: VideoCaptureSettings? {
+        didSet { applyVideoCaptureSettings() }
+    }
+    
+    // CPU 使用率と端末の温度に応じて、キャプチャーの解像度とフレームレート、送信ビットレートを調整する
+    // publishingQualityControlEnabled が true であれば、接続中に統計から判断する
+    public let publishingQualityController: PublishingQualityController =
+        PublishingQualityController()
+    public var publishingQualityControlEnabled: Bool = false
+    
     public var autofocusEnabled = false {
         didSet {
             if let session = captureSession {
@@ -403,28 +518,75 @@ public class MediaPublisher: MediaConnection {
         get {
             guard let capturer = mediaCapturer else { return nil }
             guard let stream = mainMediaStream else { return nil }
-            return stream.nativeMediaStream.audioTracks
-                .contains(capturer.audioCaptureTrack)
+            guard let track = capturer.audioCaptureTrack else { return false }
+            return stream.nativeMediaStream.audioTracks.contains(track)
         }
         
         set {
             guard let capturer = mediaCapturer else { return }
             guard let stream = mainMediaStream else { return }
             
-            let hasTrack = stream.nativeMediaStream.audioTracks
-                .contains(capturer.audioCaptureTrack)
+            let hasTrack = capturer.audioCaptureTrack.map {
+                stream.nativeMediaStream.audioTracks.contains($0) } ?? false
             switch newValue {
             case nil:
                 break
                 
             case true?:
                 if !hasTrack {
-                    stream.nativeMediaStream.addAudioTrack(capturer.audioCaptureTrack)
+                    stream.nativeMediaStream.addAudioTrack(capturer.audioPart().track)
                 }
                 
             case false?:
                 if hasTrack {
-                    stream.nativeMediaStream.removeAudioTrack(capturer.audioCaptureTrack)
+                    stream.nativeMediaStream.removeAudioTrack(capturer.audioPart().track)
+                }
+            }
+        }
+        
+    }
+    
+    // カメラの映像を送信するかどうか
+    // 映像のキャプチャーを生成していなければ、 true にしたときに生成する
+    // 接続時に映像を有効にしていなければ (MediaOption.videoEnabled) 、 true にしても何もしない
+    public var cameraEnabled: Bool? {
+        
+        get {
+            guard let capturer = mediaCapturer else { return nil }
+            guard let stream = mainMediaStream else { return nil }
+            guard let track = capturer.videoCaptureTrack else { return false }
+            return stream.nativeMediaStream.videoTracks.contains(track)
+        }
+        
+        set {
+            guard let capturer = mediaCapturer else { return }
+            guard let stream = mainMediaStream else { return }
+            
+            let hasTrack = capturer.videoCaptureTrack.map {
+                stream.nativeMediaStream.videoTracks.contains($0) } ?? false
+            switch newValue {
+            case nil:
+                break
+                
+            case true?:
+                if !hasTrack {
+                    // 映像をネゴシエーションしていなければ送信できないので追加しない
+                    guard peerConnection?.mediaOption.videoEnabled ?? false else {
+                        eventLog?.markFormat(type: eventType,
+                                             format: "cannot enable camera: video is not negotiated")
+                        return
+                    }
+                    if capturer.video == nil {
+                        eventLog?.markFormat(type: eventType,
+                                             format: "create video capturer")
+                    }
+                    stream.nativeMediaStream.addVideoTrack(capturer.videoPart().track)
+                    applyVideoCaptureSettings()
+                }
+                
+            case false?:
+                if hasTrack {
+                    stream.nativeMediaStream.removeVideoTrack(capturer.videoPart().track)
                 }
             }
         }
@@ -445,6 +607,11 @@ public class MediaPublisher: MediaConnection {
 
     override func internalOnConnect() {
         autofocusEnabled = false
+        if videoCaptureSettings == nil {
+            videoCaptureSettings = peerConnection?.mediaOption.videoCaptureSettings
+        } else {
+            applyVideoCaptureSettings()
+        }
     }
     
     public func flipCameraPosition() {
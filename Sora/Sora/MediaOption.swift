@@ -35,9 +35,39 @@ public class MediaOption {
         }
     }
     
+    // サイマルキャストを有効にすると、映像を simulcastLayers の層で送信する
+    // パブリッシャーのみ有効であり、映像コーデックは VP8 を使う
+    public var simulcastEnabled: Bool = false
+    public var simulcastLayers: [SimulcastLayer] = SimulcastLayer.defaultLayers
+    
+    // 接続中に映像の送信ビットレートをネットワークの状態に応じて調整する
+    // パブリッシャーのみ有効であり、サイマルキャストとは併用できない
+    // 初期のビットレートは bitRate (指定がなければ方針の最大ビットレート) とする
+    public var adaptiveBitrateEnabled: Bool = false
+    public var adaptiveBitratePolicy: AdaptiveBitratePolicy = AdaptiveBitratePolicy()
+    
+    // キャプチャーの解像度とフレームレート
+    // nil であれば videoCaptureSourceMediaConstraints に従う
+    public var videoCaptureSettings: VideoCaptureSettings?
+    
     public var configuration: RTCConfiguration = defaultConfiguration
     public var signalingAnswerMediaConstraints: RTCMediaConstraints = defaultMediaConstraints
     public var videoCaptureSourceMediaConstraints: RTCMediaConstraints = defaultMediaConstraints
+    
+    // キャプチャーの制約の値
+    // 設定すると videoCaptureSourceMediaConstraints をこの値から生成し直す
+    // RTCMediaConstraints からは値を取得できないので、
+    // キャプチャーを共有するかどうかはこの値で判断する (MediaCapturerPool)
+    public var videoCaptureSourceMandatoryConstraints: [String: String] = [:] {
+        didSet { updateVideoCaptureSourceMediaConstraints() }
+    }
+    public var videoCaptureSourceOptionalConstraints: [String: String] = [:] {
+        didSet { updateVideoCaptureSourceMediaConstraints() }
+    }
+    
+    // 上の値から生成した制約
+    var videoCaptureSourceMediaConstraintsFromValues: RTCMediaConstraints?
+    
     public var peerConnectionMediaConstraints: RTCMediaConstraints = defaultMediaConstraints
     public lazy var videoCaptureTrackId: String = MediaOption.createCaptureTrackId()
     public lazy var audioCaptureTrackId: String = MediaOption.createCaptureTrackId()
@@ -54,6 +84,42 @@ public class MediaOption {
     static var defaultMediaConstraints: RTCMediaConstraints =
         RTCMediaConstraints(mandatoryConstraints: nil, optionalConstraints: nil)
     
+    func updateVideoCaptureSourceMediaConstraints() {
+        let constraints = RTCMediaConstraints(
+            mandatoryConstraints: videoCaptureSourceMandatoryConstraints,
+            optionalConstraints: videoCaptureSourceOptionalConstraints)
+        videoCaptureSourceMediaConstraints = constraints
+        videoCaptureSourceMediaConstraintsFromValues = constraints
+    }
+    
+    // videoCaptureSourceMediaConstraints に直接設定した制約であれば true
+    // 直接設定した制約は値を取得できない
+    var hasOpaqueVideoCaptureSourceConstraints: Bool {
+        get {
+            let constraints = videoCaptureSourceMediaConstraints
+            return !(constraints === videoCaptureSourceMediaConstraintsFromValues ||
+                constraints === MediaOption.defaultMediaConstraints)
+        }
+    }
+    
+    // キャプチャーの制約を表す文字列
+    // 値から生成した制約 (または既定の制約) であれば値から作るので、別のオブジェクトでも値が同じなら等しい
+    // 直接設定した制約は値を取得できないので、オブジェクトで区別する
+    // (オブジェクトのアドレスは解放後に再利用されるので、キーとして使う間はオブジェクトを保持すること)
+    var videoCaptureSourceConstraintsKey: String {
+        get {
+            guard !hasOpaqueVideoCaptureSourceConstraints else {
+                return "object:\(ObjectIdentifier(videoCaptureSourceMediaConstraints).hashValue)"
+            }
+            func join(_ values: [String: String]) -> String {
+                return values.keys.sorted().map { "\($0)=\(values[$0]!)" }
+                    .joined(separator: "&")
+            }
+            return "mandatory:" + join(videoCaptureSourceMandatoryConstraints) +
+                ";optional:" + join(videoCaptureSourceOptionalConstraints)
+        }
+    }
+    
     // MARK: - トラック ID
     
     static var nextCaptureTrackId: Int = 0
@@ -49,8 +49,13 @@ public class MediaStream {
         }
         
         set {
+            stopObservingVisibility()
             if let value = newValue {
-                videoRendererAdapter = VideoRendererAdapter(videoRenderer: value)
+                videoRendererAdapter = VideoRendererAdapter(videoRenderer: value,
+                                                            referenceDate: creationTime)
+                if let view = value as? VideoView {
+                    startObservingVisibility(of: view)
+                }
             } else {
                 videoRendererAdapter = nil
             }
@@ -58,6 +63,34 @@ public class MediaStream {
         
     }
     
+    // 映像レンダラーが VideoView であり、ビューが表示されていない間は
+    // 受け取った映像フレームをメインスレッドに渡さず、描画を止める
+    // 表示の変化を検出できない場合 (ビュー階層の外での変更など) に描画が止まったままにならないよう、
+    // 既定では無効にする
+    public var pausesRenderingWhenHidden: Bool = false {
+        didSet {
+            if let view = videoRenderer as? VideoView {
+                updatePausing(isVisible: view.isVisible)
+            }
+        }
+    }
+    
+    // 描画が間に合わずに破棄した映像フレームの数
+    public var numberOfDroppedVideoFrames: Int {
+        get { return videoFrameStatistics?.numberOfDroppedFrames ?? 0 }
+    }
+    
+    // 複数の映像フレームをまとめて 1 回の描画で処理した回数
+    public var numberOfCoalescedVideoFrames: Int {
+        get { return videoFrameStatistics?.numberOfCoalescedFrames ?? 0 }
+    }
+    
+    // 映像フレームの統計
+    // 映像レンダラーがセットされていなければ nil
+    public var videoFrameStatistics: VideoFrameStatistics? {
+        get { return videoRendererAdapter?.statistics() }
+    }
+    
     var videoRendererAdapter: VideoRendererAdapter? {
         
         willSet {
@@ -86,8 +119,44 @@ public class MediaStream {
         creationTime = Date()
     }
     
+    deinit {
+        stopObservingVisibility()
+    }
+    
     func terminate() {
         stopConnectionTimer()
+        stopVideoFrameStatisticsTimer()
+        stopObservingVisibility()
+    }
+    
+    // MARK: 表示状態による描画の停止
+    
+    var visibilityObserver: NSObjectProtocol?
+    
+    func startObservingVisibility(of view: VideoView) {
+        visibilityObserver = NotificationCenter
+            .default
+            .addObserver(forName: VideoView.NotificationKey.onChangeVisibility,
+                         object: view,
+                         queue: OperationQueue.main)
+            {
+                [weak self] notification in
+                guard let view = notification.object as? VideoView else { return }
+                self?.updatePausing(isVisible: view.isVisible)
+        }
+        view.updateVisibility()
+        updatePausing(isVisible: view.isVisible)
+    }
+    
+    func stopObservingVisibility() {
+        if let observer = visibilityObserver {
+            NotificationCenter.default.removeObserver(observer)
+            visibilityObserver = nil
+        }
+    }
+    
+    func updatePausing(isVisible: Bool) {
+        videoRendererAdapter?.setPaused(pausesRenderingWhenHidden && !isVisible)
     }
     
     // MARK: タイマー
@@ -153,4 +222,33 @@ public class MediaStream {
         connectionTimerHandler = nil
     }
     
+    // MARK: 映像フレームの統計
+    
+    var videoFrameStatisticsTimer: Timer?
+    
+    // 映像フレームの統計を一定の間隔で通知する
+    // ハンドラはメインスレッドで呼ばれる
+    public func startVideoFrameStatisticsTimer(timeInterval: TimeInterval,
+                                               handler: @escaping
+        ((VideoFrameStatistics?) -> Void)) {
+        eventLog?.markFormat(type: .MediaStream,
+                             format: "start video frame statistics timer (interval %f)",
+                             arguments: timeInterval)
+        videoFrameStatisticsTimer?.invalidate()
+        videoFrameStatisticsTimer = Timer(timeInterval: timeInterval,
+                                          repeats: true) {
+            timer in
+            handler(self.videoFrameStatistics)
+        }
+        RunLoop.main.add(videoFrameStatisticsTimer!, forMode: .commonModes)
+    }
+    
+    public func stopVideoFrameStatisticsTimer() {
+        guard videoFrameStatisticsTimer != nil else { return }
+        eventLog?.markFormat(type: .MediaStream,
+                             format: "stop video frame statistics timer")
+        videoFrameStatisticsTimer?.invalidate()
+        videoFrameStatisticsTimer = nil
+    }
+    
 }
@@ -0,0 +1,106 @@
+import Foundation
+
+// ストリーム ID で索引を付けたメディアストリームの集合
+// 追加した順序を保ったまま、検索と追加を O(1) で、削除を償却 O(1) で行う
+// 削除したストリームの位置は空きにしておき、空きが増えたらまとめて詰める
+// メインスレッドからのみ使うこと
+final class MediaStreamRegistry {
+    
+    var slots: [MediaStream?] = []
+    var indexes: [String: Int] = [:]
+    var numberOfHoles: Int = 0
+    
+    // 追加した順のストリームの配列
+    // 変更がなければ前回生成した配列を返す
+    var cachedStreams: [MediaStream]?
+    
+    var streams: [MediaStream] {
+        get {
+            if let streams = cachedStreams {
+                return streams
+            }
+            var streams: [MediaStream] = []
+            streams.reserveCapacity(indexes.count)
+            for slot in slots {
+                if let stream = slot {
+                    streams.append(stream)
+                }
+            }
+            cachedStreams = streams
+            return streams
+        }
+    }
+    
+    var count: Int {
+        get { return indexes.count }
+    }
+    
+    var isEmpty: Bool {
+        get { return indexes.isEmpty }
+    }
+    
+    var first: MediaStream? {
+        get { return streams.first }
+    }
+    
+    func contains(_ mediaStreamId: String) -> Bool {
+        return indexes[mediaStreamId] != nil
+    }
+    
+    func stream(forId mediaStreamId: String) -> MediaStream? {
+        guard let index = indexes[mediaStreamId] else { return nil }
+        return slots[index]
+    }
+    
+    // 同じ ID のストリームが既にあれば追加せずに false を返す
+    @discardableResult
+    func insert(_ mediaStream: MediaStream) -> Bool {
+        let mediaStreamId = mediaStream.mediaStreamId
+        guard indexes[mediaStreamId] == nil else { return false }
+        indexes[mediaStreamId] = slots.count
+        slots.append(mediaStream)
+        cachedStreams = nil
+        return true
+    }
+    
+    @discardableResult
+    func remove(forId mediaStreamId: String) -> MediaStream? {
+        guard let index = indexes.removeValue(forKey: mediaStreamId) else {
+            return nil
+        }
+        let removed = slots[index]
+        slots[index] = nil
+        numberOfHoles += 1
+        cachedStreams = nil
+        if numberOfHoles > 16 && numberOfHoles > slots.count / 2 {
+            compact()
+        }
+        return removed
+    }
+    
+    // すべてのストリームを削除し、削除したストリームを追加した順に返す
+    @discardableResult
+    func removeAll() -> [MediaStream] {
+        let removed = streams
+        slots = []
+        indexes = [:]
+        numberOfHoles = 0
+        cachedStreams = nil
+        return removed
+    }
+    
+    // 空きを詰めて索引を作り直す
+    func compact() {
+        var compacted: [MediaStream?] = []
+        compacted.reserveCapacity(indexes.count)
+        for slot in slots {
+            if let stream = slot {
+                indexes[stream.mediaStreamId] = compacted.count
+                compacted.append(stream)
+            }
+        }
+        slots = compacted
+        numberOfHoles = 0
+    }
+    
+}
@@ -215,6 +215,12 @@ struct SignalingConnect {
             mediaOption.videoEnabled = true
             mediaOption.audioEnabled = true
         }
+        
+        // サイマルキャストの設定
+        // M57 の libwebrtc では VP8 のみサイマルキャストに対応する
+        if mediaOption.simulcastEnabled && role == .publisher {
+            mediaOption.videoCodec = .VP8
+        }
     }
 
 }
@@ -255,6 +261,10 @@ extension SignalingConnect: Messageable {
                 video["bit_rate"] = bitRate
             }
             
+            if mediaOption.simulcastEnabled && role == .publisher {
+                data["simulcast"] = true
+            }
+            
             if !video.isEmpty {
                 data["video"] = video
             }
@@ -426,6 +436,10 @@ public struct SignalingNotify {
     public var numberOfConnections: Int
     public var numberOfPublishers: Int
     public var numberOfSubscribers: Int
+    
+    // Sora のバージョンによっては含まれない
+    public var clientId: String?
+    public var connectionId: String?
 
 }
 
@@ -439,6 +453,8 @@ extension SignalingNotify: Unboxable {
         numberOfConnections = try unboxer.unbox(key: "channel_connections")
         numberOfPublishers = try unboxer.unbox(key: "channel_upstream_connections")
         numberOfSubscribers = try unboxer.unbox(key: "channel_downstream_connections")
+        clientId = unboxer.unbox(key: "client_id")
+        connectionId = unboxer.unbox(key: "connection_id")
     }
     
 }
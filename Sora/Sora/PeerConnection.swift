@@ -18,11 +18,11 @@ public class PeerConnection {
         case disconnected
     }
     
-    public static var nativeFactory: RTCPeerConnectionFactory = {
-        RTCInitializeSSL()
-        RTCEnableMetrics()
-        return RTCPeerConnectionFactory()
-    }()
+    // 既定のファクトリー
+    // 接続ごとのファクトリーは Connection.peerConnectionFactory で指定する
+    public static var nativeFactory: RTCPeerConnectionFactory {
+        get { return PeerConnectionFactoryProvider.shared.defaultFactory.start() }
+    }
     
     public weak var connection: Connection?
     public weak var mediaConnection: MediaConnection?
@@ -33,7 +33,19 @@ public class PeerConnection {
     public var clientId: String?
     
     public var state: State {
-        willSet { onChangeStateHandler?(newValue) }
+        willSet {
+            switch (state, newValue) {
+            case (_, .disconnected):
+                metricsReport?.finish()
+            case (.connected, .connecting):
+                // 再ネゴシエーションの間も接続は維持しているので段階を分けない
+                // (connected に戻ったときも同じ段階のまま)
+                break
+            default:
+                metricsReport?.beginPhase(newValue.rawValue)
+            }
+            onChangeStateHandler?(newValue)
+        }
     }
     
     public var isAvailable: Bool {
@@ -48,6 +60,27 @@ public class PeerConnection {
         get { return context?.nativePeerConnection }
     }
     
+    // マルチストリームの "update" の処理の統計
+    public var updateOfferStatistics: UpdateOfferStatistics? {
+        get { return context?.updateOfferQueue.statistics }
+    }
+    
+    // WebRTC の統計
+    // 接続している間のみ取得できる
+    public var statsCollector: StatsCollector? {
+        get { return context?.statsCollector }
+    }
+    
+    // 送信ビットレートの調整
+    // MediaOption.adaptiveBitrateEnabled が true のパブリッシャーのみ
+    public var adaptiveBitrateController: AdaptiveBitrateController? {
+        get { return context?.adaptiveBitrateController }
+    }
+    
+    // 最後の接続で WebRTC が記録したヒストグラム
+    // 接続するたびに新しいレポートに置き換わる
+    public private(set) var metricsReport: RTCMetricsReport?
+    
     var context: PeerConnectionContext?
     
     var eventLog: EventLog? {
@@ -78,6 +111,7 @@ public class PeerConnection {
         case .connected, .connecting, .disconnecting:
             handler(ConnectionError.connectionBusy)
         case .disconnected:
+            metricsReport = RTCMetricsReport(phase: State.connecting.rawValue)
             state = .connecting
             context = PeerConnectionContext(peerConnection: self, role: role)
             context!.connect(timeout: timeout, handler: handler)
@@ -104,6 +138,33 @@ public class PeerConnection {
         context = nil
     }
     
+    // MARK: サイマルキャスト
+    
+    // サイマルキャストの層の有効・無効を切り替える
+    // 視聴されていない層を無効にすると、上りの帯域と符号化の負荷を減らせる
+    // 層ごとに送信パラメーターを設定できない場合 (WebRTC M57 など) は、
+    // 上の層から順にのみ無効にでき、低い層を無効にする変更は無視する
+    public func setSimulcastLayer(at index: Int, isActive: Bool) {
+        guard index < mediaOption.simulcastLayers.count else { return }
+        var layers = mediaOption.simulcastLayers
+        layers[index].isActive = isActive
+        if let context = context, !context.canApplySimulcastLayers(layers) {
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "cannot set simulcast layer %@ to %@: lower layers must stay active",
+                                 arguments: layers[index].name,
+                                 isActive ? "active" : "inactive")
+            return
+        }
+        mediaOption.simulcastLayers = layers
+        context?.updateSimulcastEncodings()
+    }
+    
+    public func setSimulcastLayer(named name: String, isActive: Bool) {
+        if let index = mediaOption.simulcastLayers.index(where: { $0.name == name }) {
+            setSimulcastLayer(at: index, isActive: isActive)
+        }
+    }
+    
     // MARK: WebSocket
     
     func send(message: Messageable) -> ConnectionError? {
@@ -231,6 +292,18 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
         case disconnecting
         case disconnected
         case terminated
+        
+        // 接続を確立する途中の状態
+        var isConnecting: Bool {
+            get {
+                switch self {
+                case .updateOffered, .connected, .disconnecting, .disconnected, .terminated:
+                    return false
+                default:
+                    return true
+                }
+            }
+        }
     }
 
     weak var peerConnection: PeerConnection?
@@ -247,10 +320,19 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
             }
         }
         set {
+            let oldValue = _state
             _state = newValue
             switch newValue {
             case .connected:
                 peerConnection?.state = .connected
+                // 統計を利用する処理は接続を確立したときのみ開始する
+                // (update の完了で connected に戻ったときは開始しない)
+                if oldValue.isConnecting {
+                    adaptiveBitrateController?.start(context: self)
+                    startQualityEstimation()
+                    startVideoFallback()
+                    startPublishingQualityControl()
+                }
             case .disconnecting:
                 peerConnection?.state = .disconnecting
             case .disconnected:
@@ -275,7 +357,26 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
     
     var upstream: RTCMediaStream?
     var mediaCapturer: MediaCapturer?
+    var factory: PeerConnectionFactory?
+    
+    // ピア接続の生成に使ったネイティブのファクトリー
+    // キャプチャーとストリームも同じファクトリーで生成する
+    var nativeFactory: RTCPeerConnectionFactory?
     var monitor: ConnectionMonitor?
+    var updateOfferQueue: UpdateOfferQueue = UpdateOfferQueue()
+    var simulcastAnswerModifier: SimulcastAnswerModifier?
+    var adaptiveBitrateController: AdaptiveBitrateController?
+    var isEstimatingQuality: Bool = false
+    var isVideoFallbackRunning: Bool = false
+    var isVideoSuppressed: Bool = false
+    var isControllingPublishingQuality: Bool = false
+    
+    // 送信品質の調整を始めたときのアプリケーションのキャプチャーの設定と、段階の上限とする設定
+    // 段階を変更したら、調整を終えるときにアプリケーションの設定に戻す
+    var savedVideoCaptureSettings: VideoCaptureSettings?
+    var publishingQualityBaseSettings: VideoCaptureSettings?
+    var isPublishingQualityStepApplied: Bool = false
+    lazy var statsCollector: StatsCollector = StatsCollector(context: self)
     
     var connection: Connection! {
         get { return peerConnection?.connection }
@@ -297,6 +398,17 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
     init(peerConnection: PeerConnection, role: Role) {
         self.peerConnection = peerConnection
         self.role = role
+        let option = peerConnection.mediaOption
+        if role == .publisher && option.simulcastEnabled && option.videoEnabled {
+            simulcastAnswerModifier = SimulcastAnswerModifier(numberOfLayers:
+                option.simulcastLayers.count)
+        } else if role == .publisher && option.adaptiveBitrateEnabled &&
+            option.videoEnabled
+        {
+            adaptiveBitrateController =
+                AdaptiveBitrateController(policy: option.adaptiveBitratePolicy,
+                                          initialBitRate: option.bitRate)
+        }
         super.init()
     }
     
@@ -350,6 +462,12 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
             eventLog?.markFormat(type: .Signaling,
                                  format: "begin terminate all connections")
             state = .disconnecting
+            updateOfferQueue.removeAll()
+            adaptiveBitrateController?.stop()
+            stopQualityEstimation()
+            stopVideoFallback()
+            stopPublishingQualityControl()
+            statsCollector.stop()
             nativePeerConnection?.close()
             webSocket?.close()
             monitor!.terminate(error: error)
@@ -372,11 +490,18 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
         }
         
         // この順にクリアしないと落ちる
+        if let capturer = mediaCapturer {
+            MediaCapturerPool.shared.release(capturer)
+        }
         mediaCapturer = nil
         if nativePeerConnection != nil {
+            connection?.diagnosticsCapture.detach(nativePeerConnection!)
             nativePeerConnection!.delegate = nil
+            factory?.peerConnectionDidClose()
         }
         nativePeerConnection = nil
+        factory = nil
+        nativeFactory = nil
         webSocket?.delegate = nil
         webSocket = nil
         
@@ -458,12 +583,22 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
             // ピア接続オブジェクトを生成する
             eventLog?.markFormat(type: .PeerConnection,
                                  format: "create peer connection")
-            nativePeerConnection = PeerConnection.nativeFactory
-                .peerConnection(
-                    with: peerConnection!.mediaOption.configuration,
+            factory = connection.peerConnectionFactory
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "use peer connection factory '%@' (%d peer connections)",
+                                 arguments: factory!.name,
+                                 factory!.numberOfPeerConnections)
+            let created = factory!
+                .createPeerConnection(
+                    configuration: peerConnection!.mediaOption.configuration,
                     constraints: peerConnection!.mediaOption
                         .peerConnectionMediaConstraints,
                     delegate: self)
+            nativePeerConnection = created.peerConnection
+            nativeFactory = created.nativeFactory
+            connection.diagnosticsCapture.attach(nativePeerConnection!,
+                                                 name: role.rawValue,
+                                                 eventLog: eventLog)
             
             // デバイスの初期化 (Upstream)
             if role == Role.publisher {
@@ -499,44 +634,37 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
         }
     }
     
-    // 同一の RTCPeerConnectionFactory に対して MediaCapturer を再利用する
+    // 同一の RTCPeerConnectionFactory とキャプチャーの制約に対して MediaCapturer を再利用する
     // MediaCapturer を複数回生成すると落ちる可能性がある
-    static var sharedMediaCapturers: [RTCPeerConnectionFactory: MediaCapturer] = [:]
-    
     func createMediaCapturer() -> ConnectionError? {
         eventLog?.markFormat(type: .PeerConnection, format: "create media capturer")
-        if let shared = PeerConnectionContext
-            .sharedMediaCapturers[PeerConnection.nativeFactory] {
-            eventLog?.markFormat(type: .PeerConnection,
-                                 format: "use shared media capturer")
-            mediaCapturer = shared
-        } else {
-            mediaCapturer = MediaCapturer(
-                factory: PeerConnection.nativeFactory,
-                mediaOption: peerConnection!.mediaOption)
-            if mediaCapturer == nil {
-                eventLog?.markFormat(type: .PeerConnection,
-                                     format: "create media capturer failed")
-                return ConnectionError.mediaCapturerFailed
-            }
-            PeerConnectionContext
-                .sharedMediaCapturers[PeerConnection.nativeFactory] = mediaCapturer
-        }
-        
-        eventLog?.markFormat(type: .PeerConnection,
-                             format: "video capturer track ID: %@",
-                             arguments: mediaCapturer!.videoCaptureTrack.trackId)
+        let pool = MediaCapturerPool.shared
+        let nativeFactory = self.nativeFactory!
+        let (capturer, isReused) = pool.acquire(factory: nativeFactory,
+                                                mediaOption: peerConnection!.mediaOption)
+        mediaCapturer = capturer
         eventLog?.markFormat(type: .PeerConnection,
-                             format: "audio capturer track ID: %@",
-                             arguments: mediaCapturer!.audioCaptureTrack.trackId)
+                             format: "%@ media capturer (live %d, pooled %d)",
+                             arguments: isReused ? "reuse" : "create",
+                             pool.numberOfLiveCapturers,
+                             pool.numberOfPooledCapturers)
         
-        let upstream = PeerConnection.nativeFactory.mediaStream(withStreamId:
+        // 映像と音声のキャプチャーは、有効であれば生成する
+        let upstream = nativeFactory.mediaStream(withStreamId:
             peerConnection!.mediaStreamId ?? MediaStream.defaultStreamId)
         if peerConnection!.mediaOption.videoEnabled {
-            upstream.addVideoTrack(mediaCapturer!.videoCaptureTrack)
+            let video = mediaCapturer!.videoPart()
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "video capturer track ID: %@",
+                                 arguments: video.track.trackId)
+            upstream.addVideoTrack(video.track)
         }
         if peerConnection!.mediaOption.audioEnabled {
-            upstream.addAudioTrack(mediaCapturer!.audioCaptureTrack)
+            let audio = mediaCapturer!.audioPart()
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "audio capturer track ID: %@",
+                                 arguments: audio.track.trackId)
+            upstream.addAudioTrack(audio.track)
         }
         
         nativePeerConnection!.add(upstream)
@@ -682,6 +810,7 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
             let nums = (notify.numberOfPublishers,
                         notify.numberOfSubscribers)
             mediaConnection!.numberOfConnections = nums
+            mediaConnection!.attendeeRoster.apply(notify: notify)
             let attendee = Attendee(role: notify.role,
                                     numberOfPublishers: notify.numberOfPublishers,
                                     numberOfSubscribers: notify.numberOfSubscribers)
@@ -774,13 +903,14 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
             self.nativePeerConnection!.answer(for: self
                 .peerConnection!.mediaOption.signalingAnswerMediaConstraints)
             {
-                (sdp, error) in
+                (answerSdp, error) in
                 if let error = error {
                     self.eventLog?.markFormat(type: .Signaling,
                                               format: "creating answer failed")
                     self.terminateByPeerConnection(error: error)
                     return
                 }
+                let sdp: RTCSessionDescription! = self.modifyAnswerForSimulcast(answerSdp!)
                 self.eventLog?.markFormat(type: .Signaling,
                                           format: "generated answer: %@",
                                           arguments: sdp!)
@@ -794,6 +924,7 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
                         self.terminate(error: ConnectionError.peerConnectionError(error))
                         return
                     }
+                    self.updateSimulcastEncodings()
                     
                     self.eventLog?.markFormat(type: .Signaling,
                                               format: "send answer")
@@ -811,7 +942,7 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
     
     func receiveSignalingUpdate(_ json: [String: Any]) {
         switch state {
-        case .connected:
+        case .connected, .updateOffered:
             eventLog?.markFormat(type: .Signaling, format: "received 'update'",
                                  arguments: json.description)
             if !mediaConnection.multistreamEnabled {
@@ -829,13 +960,33 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
                 return
             }
             
-            createAndSendUpdateAnswer(sdp: update.sessionDescription())
+            // 処理中の update があれば、完了してから適用する
+            if let next = updateOfferQueue.enqueue(update) {
+                createAndSendUpdateAnswer(sdp: next.sessionDescription())
+            } else {
+                eventLog?.markFormat(type: .Signaling,
+                                     format: "queue 'update' (depth %d)",
+                                     arguments: updateOfferQueue.statistics.queueDepth)
+            }
             
         default:
             return
         }
     }
     
+    // 処理中の update を完了し、処理を待つ update があれば続けて適用する
+    // update のキューはメインスレッドからのみ操作する
+    func finishUpdate(succeeded: Bool) {
+        guard let next = updateOfferQueue.finish(succeeded: succeeded) else {
+            return
+        }
+        guard state == .connected else {
+            updateOfferQueue.removeAll()
+            return
+        }
+        eventLog?.markFormat(type: .Signaling, format: "dequeue 'update'")
+        createAndSendUpdateAnswer(sdp: next.sessionDescription())
+    }
     
     func createAndSendUpdateAnswer(sdp: RTCSessionDescription) {
         state = .updateOffered
@@ -855,13 +1006,14 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
             self.nativePeerConnection!.answer(for: self
                 .peerConnection!.mediaOption.signalingAnswerMediaConstraints)
             {
-                (sdp, error) in
+                (answerSdp, error) in
                 if let error = error {
                     self.eventLog?.markFormat(type: .Signaling,
                                               format: "creating update-answer failed")
                     self.terminateUpdate(error)
                     return
                 }
+                let sdp: RTCSessionDescription! = self.modifyAnswerForSimulcast(answerSdp!)
                 self.eventLog?.markFormat(type: .Signaling,
                                           format: "generated update-answer: %@",
                                           arguments: sdp!)
@@ -873,6 +1025,7 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
                         self.terminateUpdate(error)
                         return
                     }
+                    self.updateSimulcastEncodings()
                     
                     self.eventLog?.markFormat(type: .Signaling,
                                               format: "send update-answer")
@@ -886,7 +1039,15 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
                     // Answer 送信後に RTCPeerConnection の状態に変化はない
                     // (デリゲートのメソッドが呼ばれない) ため、
                     // Answer を送信したら接続完了とみなす
-                    self.state = .connected
+                    // このブロックは WebRTC のスレッドで実行されるので、
+                    // update のキューはメインスレッドで操作する
+                    DispatchQueue.main.async {
+                        // 終了処理の後であれば接続済みに戻さない
+                        if self.state == .updateOffered {
+                            self.state = .connected
+                        }
+                        self.finishUpdate(succeeded: true)
+                    }
                 }
             }
         }
@@ -917,6 +1078,11 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
                 return
             }
             
+            if mediaConnection.incrementalSnapshotEnabled {
+                decodeSnapshotIncrementally(sigSnapshot)
+                return
+            }
+            
             do {
                 eventLog?.markFormat(type: .Snapshot,
                                      format: "try decode base64 encoded text")
@@ -948,14 +1114,80 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
         }
     }
     
+    // 段階的なデコードはメインスレッド以外で行う
+    // 途中経過のスナップショットはメインスレッドで描画する
+    static var snapshotDecodingQueue: DispatchQueue =
+        DispatchQueue(label: "jp.shiguredo.Sora.snapshot", qos: .userInitiated)
+    
+    // 新しいスナップショットを受信したら、
+    // デコード中の古いスナップショットは描画しない
+    var snapshotGeneration: Int = 0
+    
+    func decodeSnapshotIncrementally(_ sigSnapshot: SignalingSnapshot) {
+        eventLog?.markFormat(type: .Snapshot,
+                             format: "try decode snapshot incrementally")
+        snapshotGeneration += 1
+        let generation = snapshotGeneration
+        let chunkSize = mediaConnection.incrementalSnapshotChunkSize
+        PeerConnectionContext.snapshotDecodingQueue.async {
+            [weak self] in
+            do {
+                let snapshot = try IncrementalSnapshotDecoder
+                    .decode(base64Encoded: sigSnapshot.base64EncodedString,
+                            chunkSize: chunkSize)
+                    {
+                        partial in
+                        DispatchQueue.main.async {
+                            guard let weakSelf = self else { return }
+                            guard generation == weakSelf.snapshotGeneration else {
+                                return
+                            }
+                            weakSelf.mediaConnection?.render(partialSnapshot: partial)
+                        }
+                }
+                DispatchQueue.main.async {
+                    guard let weakSelf = self else { return }
+                    guard generation == weakSelf.snapshotGeneration else {
+                        weakSelf.eventLog?.markFormat(type: .Snapshot,
+                                                      format: "discard old snapshot")
+                        return
+                    }
+                    weakSelf.signalingEventHandlers?.onSnapshotHandler?(sigSnapshot)
+                    weakSelf.mediaConnection?.render(snapshot: snapshot)
+                }
+            } catch SnapshotError.invalidBase64Format {
+                DispatchQueue.main.async {
+                    self?.eventLog?.markFormat(type: .Snapshot,
+                                               format: "invalid base64 format")
+                }
+            } catch {
+                DispatchQueue.main.async {
+                    self?.eventLog?.markFormat(type: .Snapshot,
+                                               format: "incremental WebP decode failed")
+                }
+            }
+        }
+    }
+    
     // マルチストリームのシグナリングのエラー
+    // WebRTC のスレッドから呼ばれるので、メインスレッドで処理する
     func terminateUpdate(_ error: Error) {
-        state = .connected
-        let connError = ConnectionError.peerConnectionError(error)
-        let updateError = ConnectionError.updateError(connError)
-        peerConnectionEventHandlers?
-            .onFailureHandler?(nativePeerConnection!, updateError)
-        mediaConnection?.callOnFailureHandler(updateError)
+        DispatchQueue.main.async {
+            // 終了処理の後であれば接続済みに戻さない
+            guard self.state == .updateOffered else {
+                self.finishUpdate(succeeded: false)
+                return
+            }
+            self.state = .connected
+            let connError = ConnectionError.peerConnectionError(error)
+            let updateError = ConnectionError.updateError(connError)
+            if let nativePeerConnection = self.nativePeerConnection {
+                self.peerConnectionEventHandlers?
+                    .onFailureHandler?(nativePeerConnection, updateError)
+            }
+            self.mediaConnection?.callOnFailureHandler(updateError)
+            self.finishUpdate(succeeded: false)
+        }
     }
     
     // MARK: RTCPeerConnectionDelegate
@@ -1092,7 +1324,7 @@ class PeerConnectionContext: NSObject, SRWebSocketDelegate, RTCPeerConnectionDel
         eventLog?.markFormat(type: .PeerConnection,
                              format: "finish connection")
         
-        if mediaConnection!.mediaStreams.isEmpty {
+        if mediaConnection!.mediaStreamRegistry.isEmpty {
             eventLog?.markFormat(type: .PeerConnection,
                                  format: "media stream is not found")
             terminate(error: .mediaStreamNotFound)
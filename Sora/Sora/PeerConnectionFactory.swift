@@ -0,0 +1,204 @@
+import Foundation
+import WebRTC
+
+// RTCPeerConnectionFactory の生成と終了を管理する
+// RTCPeerConnectionFactory はネットワーク、ワーカー、シグナリングのスレッドを生成して所有するので、
+// 接続ごとに別のファクトリーを使えば、スレッドを分けて負荷を分散できる
+// ただしファクトリーごとに音声デバイスモジュールも生成されるので、
+// 複数のファクトリーで同時に音声を送信すると音声セッションを奪い合う
+// (Connection.peerConnectionFactory を参照)
+// ファクトリーごとにピア接続の数を数えるので、ファクトリーごとの負荷を確認できる
+// スレッドセーフであり、どのスレッドからでも利用できる
+public final class PeerConnectionFactory {
+    
+    public let name: String
+    
+    // 生成したネイティブのファクトリー
+    // 開始していなければ nil
+    public var nativeFactory: RTCPeerConnectionFactory? {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _nativeFactory
+        }
+    }
+    
+    public var isRunning: Bool {
+        get { return nativeFactory != nil }
+    }
+    
+    // 開始した時刻
+    public var startDate: Date? {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _startDate
+        }
+    }
+    
+    // 接続中のピア接続の数
+    public var numberOfPeerConnections: Int {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _numberOfPeerConnections
+        }
+    }
+    
+    // 開始してから生成したピア接続の数
+    public var totalNumberOfPeerConnections: Int {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _totalNumberOfPeerConnections
+        }
+    }
+    
+    let lock: NSLock = NSLock()
+    var _nativeFactory: RTCPeerConnectionFactory?
+    var _startDate: Date?
+    var _numberOfPeerConnections: Int = 0
+    var _totalNumberOfPeerConnections: Int = 0
+    
+    // SSL とヒストグラムの記録はプロセスで 1 回だけ初期化する
+    static let initializeOnce: Void = {
+        RTCInitializeSSL()
+        RTCEnableMetrics()
+    }()
+    
+    public init(name: String) {
+        self.name = name
+    }
+    
+    // ネイティブのファクトリーとスレッドを生成する
+    // 開始していれば何もしない
+    @discardableResult
+    public func start() -> RTCPeerConnectionFactory {
+        _ = PeerConnectionFactory.initializeOnce
+        lock.lock()
+        defer { lock.unlock() }
+        return startLocked()
+    }
+    
+    // ロックしてから呼ぶ
+    func startLocked() -> RTCPeerConnectionFactory {
+        if let factory = _nativeFactory {
+            return factory
+        }
+        let factory = RTCPeerConnectionFactory()
+        _nativeFactory = factory
+        _startDate = Date()
+        _totalNumberOfPeerConnections = 0
+        return factory
+    }
+    
+    // ネイティブのファクトリーを解放して、スレッドを終了する
+    // 接続中のピア接続があれば終了せずに false を返す
+    // プールに残っているこのファクトリーのキャプチャーも解放する
+    @discardableResult
+    public func shutdown() -> Bool {
+        lock.lock()
+        guard _numberOfPeerConnections == 0 else {
+            lock.unlock()
+            return false
+        }
+        let factory = _nativeFactory
+        _nativeFactory = nil
+        _startDate = nil
+        lock.unlock()
+        
+        if let factory = factory {
+            MediaCapturerPool.shared.evictIdleCapturers(for: factory)
+        }
+        return true
+    }
+    
+    // ピア接続を生成する
+    // 開始していなければ開始する
+    // 生成に使ったネイティブのファクトリーも返す
+    // 開始とピア接続の数の追加を同じロックで行い、生成中に shutdown() で終了されないようにする
+    func createPeerConnection(configuration: RTCConfiguration,
+                              constraints: RTCMediaConstraints,
+                              delegate: RTCPeerConnectionDelegate?)
+        -> (peerConnection: RTCPeerConnection, nativeFactory: RTCPeerConnectionFactory)
+    {
+        _ = PeerConnectionFactory.initializeOnce
+        lock.lock()
+        let factory = startLocked()
+        _numberOfPeerConnections += 1
+        _totalNumberOfPeerConnections += 1
+        lock.unlock()
+        let native = factory.peerConnection(with: configuration,
+                                            constraints: constraints,
+                                            delegate: delegate)
+        return (native, factory)
+    }
+    
+    // ピア接続を閉じたときに呼ぶ
+    func peerConnectionDidClose() {
+        lock.lock()
+        _numberOfPeerConnections = max(0, _numberOfPeerConnections - 1)
+        lock.unlock()
+    }
+    
+}
+
+// 名前を付けたファクトリーを提供する
+// Connection.peerConnectionFactory に設定して、接続ごとにファクトリーを使い分ける
+// スレッドセーフであり、どのスレッドからでも利用できる
+public final class PeerConnectionFactoryProvider {
+    
+    public static let shared: PeerConnectionFactoryProvider = PeerConnectionFactoryProvider()
+    
+    public static let defaultFactoryName: String = "default"
+    
+    // 特に指定しない接続が使うファクトリー
+    public let defaultFactory: PeerConnectionFactory =
+        PeerConnectionFactory(name: PeerConnectionFactoryProvider.defaultFactoryName)
+    
+    // 提供しているファクトリー (既定のファクトリーを含む)
+    public var factories: [PeerConnectionFactory] {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return [defaultFactory] + namedFactories.keys.sorted().map { namedFactories[$0]! }
+        }
+    }
+    
+    let lock: NSLock = NSLock()
+    var namedFactories: [String: PeerConnectionFactory] = [:]
+    
+    init() {}
+    
+    // 名前に対応するファクトリーを返す
+    // なければ生成する (開始はピア接続の生成時に行う)
+    public func factory(named name: String) -> PeerConnectionFactory {
+        if name == PeerConnectionFactoryProvider.defaultFactoryName {
+            return defaultFactory
+        }
+        lock.lock()
+        defer { lock.unlock() }
+        if let factory = namedFactories[name] {
+            return factory
+        }
+        let factory = PeerConnectionFactory(name: name)
+        namedFactories[name] = factory
+        return factory
+    }
+    
+    // 名前に対応するファクトリーを終了して取り除く
+    // 接続中のピア接続があれば終了せずに false を返す
+    // 既定のファクトリーは終了するが取り除かない
+    @discardableResult
+    public func removeFactory(named name: String) -> Bool {
+        let factory = self.factory(named: name)
+        guard factory.shutdown() else { return false }
+        if factory !== defaultFactory {
+            lock.lock()
+            namedFactories.removeValue(forKey: name)
+            lock.unlock()
+        }
+        return true
+    }
+    
+}
@@ -0,0 +1,468 @@
+import Foundation
+import QuartzCore
+import WebRTC
+
+// 端末の温度の状態
+// ProcessInfo.ThermalState (iOS 11 以降) に対応する
+public enum PublishingThermalState: Int, Comparable {
+    
+    case nominal
+    case fair
+    case serious
+    case critical
+    
+    public static func <(lhs: PublishingThermalState,
+                         rhs: PublishingThermalState) -> Bool {
+        return lhs.rawValue < rhs.rawValue
+    }
+    
+}
+
+// CPU 使用率と端末の温度の状態を読み取る
+// テストでは任意の値を返す実装に置き換えられる
+public protocol PublishingQualitySensor {
+    
+    // プロセスの CPU 使用率 (0 から 1)
+    // すべてのコアを使い切ると 1 になる
+    func readCPUUsage() -> Double?
+    
+    func readThermalState() -> PublishingThermalState
+    
+}
+
+// 端末の値を読み取る
+public struct SystemPublishingQualitySensor: PublishingQualitySensor {
+    
+    public init() {}
+    
+    public func readCPUUsage() -> Double? {
+        var threads: thread_act_array_t?
+        var count: mach_msg_type_number_t = 0
+        guard task_threads(mach_task_self_, &threads, &count) == KERN_SUCCESS,
+            let list = threads else { return nil }
+        // task_threads はスレッドごとに送信権を返すので、配列とともに解放する
+        defer {
+            for i in 0..<Int(count) {
+                mach_port_deallocate(mach_task_self_, list[i])
+            }
+            vm_deallocate(mach_task_self_,
+                          vm_address_t(bitPattern: list),
+                          vm_size_t(Int(count) * MemoryLayout<thread_t>.stride))
+        }
+        
+        var total = 0.0
+        for i in 0..<Int(count) {
+            var info = thread_basic_info()
+            var infoCount = mach_msg_type_number_t(
+                MemoryLayout<thread_basic_info>.size / MemoryLayout<integer_t>.size)
+            let result = withUnsafeMutablePointer(to: &info) {
+                $0.withMemoryRebound(to: integer_t.self, capacity: Int(infoCount)) {
+                    thread_info(list[i], thread_flavor_t(THREAD_BASIC_INFO), $0, &infoCount)
+                }
+            }
+            guard result == KERN_SUCCESS else { continue }
+            if info.flags & TH_FLAGS_IDLE == 0 {
+                total += Double(info.cpu_usage) / Double(TH_USAGE_SCALE)
+            }
+        }
+        return total / Double(max(1, ProcessInfo.processInfo.activeProcessorCount))
+    }
+    
+    public func readThermalState() -> PublishingThermalState {
+        #if swift(>=3.2)
+            if #available(iOS 11.0, *) {
+                switch ProcessInfo.processInfo.thermalState {
+                case .nominal: return .nominal
+                case .fair: return .fair
+                case .serious: return .serious
+                case .critical: return .critical
+                }
+            }
+        #endif
+        return .nominal
+    }
+    
+}
+
+// 送信品質の段階
+// ビットレートの単位は kbps
+public struct PublishingQualityStep {
+    
+    public var name: String
+    public var width: Int
+    public var height: Int
+    public var frameRate: Int
+    public var bitRate: Int
+    
+    public init(name: String, width: Int, height: Int, frameRate: Int, bitRate: Int) {
+        self.name = name
+        self.width = width
+        self.height = height
+        self.frameRate = frameRate
+        self.bitRate = bitRate
+    }
+    
+    public var captureSettings: VideoCaptureSettings {
+        get {
+            return VideoCaptureSettings(width: width, height: height, frameRate: frameRate)
+        }
+    }
+    
+}
+
+// 送信品質の調整の方針
+public struct PublishingQualityPolicy {
+    
+    // 品質の段階 (高い順)
+    public var steps: [PublishingQualityStep] = [
+        PublishingQualityStep(name: "720p", width: 1280, height: 720, frameRate: 30, bitRate: 1500),
+        PublishingQualityStep(name: "540p", width: 960, height: 540, frameRate: 30, bitRate: 1000),
+        PublishingQualityStep(name: "360p", width: 640, height: 360, frameRate: 24, bitRate: 600),
+        PublishingQualityStep(name: "270p", width: 480, height: 270, frameRate: 15, bitRate: 300),
+        PublishingQualityStep(name: "180p", width: 320, height: 180, frameRate: 15, bitRate: 150)]
+    
+    // 接続時のキャプチャーの設定が分からないときの段階
+    public var initialStepIndex: Int = 0
+    
+    // CPU 使用率がこの値以上であれば下げ、この値以下であれば上げられる
+    public var highCPUUsage: Double = 0.8
+    public var lowCPUUsage: Double = 0.5
+    
+    // 符号化にかかる時間の割合がこの値以上であれば下げ、この値以下であれば上げられる
+    public var highEncodeUsage: Double = 0.85
+    public var lowEncodeUsage: Double = 0.5
+    
+    // キャプチャーしたフレームのうち送信しなかった割合がこの値以上であれば下げ、
+    // この値以下であれば上げられる
+    public var highFrameDropRate: Double = 0.2
+    public var lowFrameDropRate: Double = 0.05
+    
+    // 温度の状態がこの値以上であれば下げ、この値以下であれば上げられる
+    // critical であれば最低の段階まで下げる
+    public var highThermalState: PublishingThermalState = .serious
+    public var lowThermalState: PublishingThermalState = .fair
+    
+    // 下げる (上げる) までに続けて必要な標本の数
+    // 上げるほうを多くして、段階が振動しないようにする
+    public var numberOfSamplesToDowngrade: Int = 3
+    public var numberOfSamplesToUpgrade: Int = 10
+    
+    // 段階を変えてからこの時間 (秒) は段階を上げない
+    public var holdTimeAfterDowngrade: TimeInterval = 30
+    
+    public init() {}
+    
+}
+
+// 送信品質の調整に使う標本
+// 取得できない値は nil とし、判断に含めない
+public struct PublishingQualitySample {
+    
+    public var cpuUsage: Double?
+    public var thermalState: PublishingThermalState
+    public var encodeUsage: Double?
+    public var frameDropRate: Double?
+    
+    public init(cpuUsage: Double?,
+                thermalState: PublishingThermalState = .nominal,
+                encodeUsage: Double? = nil,
+                frameDropRate: Double? = nil) {
+        self.cpuUsage = cpuUsage
+        self.thermalState = thermalState
+        self.encodeUsage = encodeUsage
+        self.frameDropRate = frameDropRate
+    }
+    
+}
+
+// 送信品質の段階の変更
+public struct PublishingQualityDecision {
+    
+    public var previousStepIndex: Int
+    public var stepIndex: Int
+    public var step: PublishingQualityStep
+    
+    // 変更の理由 (ログ用)
+    public var reason: String
+    
+    // 変更した時刻 (秒)
+    public var time: TimeInterval
+    
+}
+
+// CPU 使用率、端末の温度、符号化の負荷とフレームの欠落から、
+// キャプチャーの解像度とフレームレート、送信ビットレートを段階的に上げ下げする
+// 下げるのは早く、上げるのは遅くして、端末が熱を持つ前に負荷を下げる
+// update(_:time:) は接続がなくても使えるので、任意の標本を与えて方針を確認できる
+// メインスレッドからのみ使うこと
+public class PublishingQualityController {
+    
+    public var policy: PublishingQualityPolicy
+    
+    // CPU 使用率と温度の読み取りに使う
+    public var sensor: PublishingQualitySensor = SystemPublishingQualitySensor()
+    
+    public private(set) var stepIndex: Int
+    
+    public var currentStep: PublishingQualityStep? {
+        get {
+            guard stepIndex < policy.steps.count else { return nil }
+            return policy.steps[stepIndex]
+        }
+    }
+    
+    // 変更の履歴
+    // 最新の PublishingQualityController.maxNumberOfDecisions 件を保持する
+    public private(set) var decisions: [PublishingQualityDecision] = []
+    
+    public static var maxNumberOfDecisions: Int = 100
+    
+    // この段階より上げない
+    public private(set) var highestStepIndex: Int = 0
+    
+    var consecutiveHighSamples: Int = 0
+    var consecutiveLowSamples: Int = 0
+    var lastDowngradeTime: TimeInterval?
+    
+    var onChangeHandler: ((PublishingQualityDecision) -> Void)?
+    
+    public init(policy: PublishingQualityPolicy = PublishingQualityPolicy()) {
+        self.policy = policy
+        stepIndex = PublishingQualityController.initialStepIndex(of: policy)
+    }
+    
+    static func initialStepIndex(of policy: PublishingQualityPolicy) -> Int {
+        return max(0, min(policy.initialStepIndex, policy.steps.count - 1))
+    }
+    
+    // 段階を変更したときに呼ばれるハンドラ
+    public func onChange(handler: @escaping (PublishingQualityDecision) -> Void) {
+        onChangeHandler = handler
+    }
+    
+    // sensor から読み取った値と、 WebRTC の統計から標本を作る
+    public func sample(stats: RTPStreamStats?) -> PublishingQualitySample {
+        var sample = PublishingQualitySample(cpuUsage: sensor.readCPUUsage(),
+                                             thermalState: sensor.readThermalState())
+        if let stats = stats {
+            sample.encodeUsage = stats.encodeUsage
+            if let input = stats.inputFrameRate, input > 0,
+                let sent = stats.sentFrameRate {
+                sample.frameDropRate = max(0, 1 - sent / input)
+            }
+        }
+        return sample
+    }
+    
+    // 標本を与えて段階を更新する
+    // 段階を変更すれば変更を返す
+    @discardableResult
+    public func update(_ sample: PublishingQualitySample,
+                       time: TimeInterval = CACurrentMediaTime()) -> PublishingQualityDecision? {
+        guard !policy.steps.isEmpty else { return nil }
+        let lowest = policy.steps.count - 1
+        
+        if sample.thermalState == .critical && stepIndex < lowest {
+            return change(to: lowest, reason: "thermal state critical", time: time)
+        }
+        
+        var reasons: [String] = []
+        if sample.thermalState >= policy.highThermalState {
+            reasons.append(String(format: "thermal state %d", sample.thermalState.rawValue))
+        }
+        if let cpu = sample.cpuUsage, cpu >= policy.highCPUUsage {
+            reasons.append(String(format: "cpu %.2f", cpu))
+        }
+        if let usage = sample.encodeUsage, usage >= policy.highEncodeUsage {
+            reasons.append(String(format: "encode usage %.2f", usage))
+        }
+        if let drop = sample.frameDropRate, drop >= policy.highFrameDropRate {
+            reasons.append(String(format: "frame drop %.2f", drop))
+        }
+        
+        if !reasons.isEmpty {
+            consecutiveLowSamples = 0
+            consecutiveHighSamples += 1
+            if consecutiveHighSamples >= policy.numberOfSamplesToDowngrade && stepIndex < lowest {
+                return change(to: stepIndex + 1,
+                              reason: reasons.joined(separator: ", "),
+                              time: time)
+            }
+            return nil
+        }
+        
+        let isLow = sample.thermalState <= policy.lowThermalState &&
+            (sample.cpuUsage.map { $0 <= policy.lowCPUUsage } ?? true) &&
+            (sample.encodeUsage.map { $0 <= policy.lowEncodeUsage } ?? true) &&
+            (sample.frameDropRate.map { $0 <= policy.lowFrameDropRate } ?? true)
+        guard isLow else {
+            // 上げも下げもしない範囲では、続けた標本の数を数え直す
+            consecutiveHighSamples = 0
+            consecutiveLowSamples = 0
+            return nil
+        }
+        
+        consecutiveHighSamples = 0
+        consecutiveLowSamples += 1
+        if let last = lastDowngradeTime, time - last < policy.holdTimeAfterDowngrade {
+            return nil
+        }
+        if consecutiveLowSamples >= policy.numberOfSamplesToUpgrade && stepIndex > highestStepIndex {
+            return change(to: stepIndex - 1, reason: "load recovered", time: time)
+        }
+        return nil
+    }
+    
+    public func reset() {
+        stepIndex = PublishingQualityController.initialStepIndex(of: policy)
+        highestStepIndex = 0
+        decisions = []
+        consecutiveHighSamples = 0
+        consecutiveLowSamples = 0
+        lastDowngradeTime = nil
+    }
+    
+    // 指定したキャプチャーの設定を超えない最も高い段階から始める
+    // 段階を上げてもその段階までとし、アプリケーションの設定より品質を上げない
+    // 設定を超えない段階がなければ最低の段階とする
+    public func reset(notExceeding settings: VideoCaptureSettings) {
+        reset()
+        guard !policy.steps.isEmpty else { return }
+        let long = max(settings.width, settings.height)
+        let short = min(settings.width, settings.height)
+        let index = policy.steps.index(where: {
+            max($0.width, $0.height) <= long &&
+                min($0.width, $0.height) <= short &&
+                $0.frameRate <= settings.frameRate
+        }) ?? policy.steps.count - 1
+        stepIndex = index
+        highestStepIndex = index
+    }
+    
+    func change(to index: Int, reason: String, time: TimeInterval) -> PublishingQualityDecision {
+        let decision = PublishingQualityDecision(previousStepIndex: stepIndex,
+                                                 stepIndex: index,
+                                                 step: policy.steps[index],
+                                                 reason: reason,
+                                                 time: time)
+        if index > stepIndex {
+            lastDowngradeTime = time
+        }
+        stepIndex = index
+        consecutiveHighSamples = 0
+        consecutiveLowSamples = 0
+        if decisions.count >= PublishingQualityController.maxNumberOfDecisions {
+            decisions.removeFirst()
+        }
+        decisions.append(decision)
+        onChangeHandler?(decision)
+        return decision
+    }
+    
+}
+
+// MARK: - 統計からの調整
+
+extension PeerConnectionContext {
+    
+    // 統計を取得するたびに送信品質を判断する
+    func startPublishingQualityControl() {
+        guard !isControllingPublishingQuality,
+            role == .publisher,
+            let publisher = mediaConnection as? MediaPublisher,
+            publisher.publishingQualityControlEnabled,
+            peerConnection?.mediaOption.videoEnabled ?? false else { return }
+        isControllingPublishingQuality = true
+        
+        // 接続時はアプリケーションの設定を変えず、設定に近い段階から始める
+        // 段階は最初に変更したときに適用する
+        let controller = publisher.publishingQualityController
+        savedVideoCaptureSettings = publisher.videoCaptureSettings
+        publishingQualityBaseSettings = publisher.videoCaptureSettings ??
+            peerConnection?.mediaOption.videoCaptureSettings ??
+            publisher.activeVideoCaptureFormat.map {
+                VideoCaptureSettings(width: $0.width, height: $0.height,
+                                     frameRate: Int($0.maxFrameRate)) }
+        isPublishingQualityStepApplied = false
+        if let settings = publishingQualityBaseSettings {
+            controller.reset(notExceeding: settings)
+        } else {
+            controller.reset()
+        }
+        if let step = controller.currentStep {
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "start publishing quality control (%@)",
+                                 arguments: step.name)
+        }
+        statsCollector.addInternalUpdateHandler(key: .publishingQuality) {
+            [weak self] collector in
+            guard let weakSelf = self, weakSelf.isControllingPublishingQuality else {
+                return
+            }
+            let stats = collector.latestStats(mediaType: "video", direction: .send).first
+            let sample = controller.sample(stats: stats)
+            if let decision = controller.update(sample) {
+                weakSelf.eventLog?.markFormat(type: .PeerConnection,
+                                              format: "publishing quality: %@ -> %@ (%@)",
+                                              arguments: controller.policy.steps[decision.previousStepIndex].name,
+                                              decision.step.name,
+                                              decision.reason)
+                weakSelf.applyPublishingQualityStep(
+                    decision.step,
+                    isHighest: decision.stepIndex == controller.highestStepIndex)
+            }
+        }
+        statsCollector.start()
+    }
+    
+    // 段階を変更していれば、アプリケーションのキャプチャーの設定に戻す
+    // 終了処理はメインスレッド以外からも呼ばれるので、メインスレッドで戻す
+    func stopPublishingQualityControl() {
+        isControllingPublishingQuality = false
+        statsCollector.removeInternalUpdateHandler(key: .publishingQuality)
+        if isPublishingQualityStepApplied,
+            let publisher = mediaConnection as? MediaPublisher
+        {
+            let settings = savedVideoCaptureSettings
+            DispatchQueue.main.async {
+                publisher.videoCaptureSettings = settings
+            }
+        }
+        isPublishingQualityStepApplied = false
+    }
+    
+    // キャプチャーの設定と送信ビットレートを段階に合わせる
+    // キャプチャーの設定は調整を始めたときの設定を超えないようにし、
+    // ビットレートは MediaOption.bitRate を超えないようにする
+    // 最も高い段階に戻ったら、調整を始めたときの設定と制限のない状態に戻す
+    // 送信ビットレートの調整が有効であれば、その上限を段階のビットレートにする
+    // サイマルキャストでは層ごとのビットレートを優先し、ビットレートは変えない
+    func applyPublishingQualityStep(_ step: PublishingQualityStep, isHighest: Bool) {
+        isPublishingQualityStepApplied = true
+        let base = publishingQualityBaseSettings
+        if let publisher = mediaConnection as? MediaPublisher {
+            if isHighest {
+                publisher.videoCaptureSettings = savedVideoCaptureSettings ?? base
+            } else {
+                publisher.videoCaptureSettings = base.map {
+                    step.captureSettings.capped(to: $0) } ?? step.captureSettings
+            }
+        }
+        
+        let mediaBitRate = peerConnection?.mediaOption.bitRate
+        let bitRate: Int? = isHighest ? nil : min(step.bitRate, mediaBitRate ?? Int.max)
+        if let controller = adaptiveBitrateController {
+            controller.limit(maxBitRate: bitRate)
+        } else if !(peerConnection?.mediaOption.simulcastEnabled ?? false) {
+            let maxBitRate = bitRate ?? mediaBitRate
+            for sender in videoSenders {
+                let parameters = sender.parameters
+                for encoding in parameters.encodings {
+                    encoding.maxBitrateBps = maxBitRate.map { NSNumber(value: $0 * 1000) }
+                }
+                sender.parameters = parameters
+            }
+        }
+    }
+    
+}
@@ -0,0 +1,319 @@
+import Foundation
+import WebRTC
+
+// WebRTC が記録するヒストグラム (RTCMetricsSampleInfo) の 1 つ
+public struct RTCMetricsHistogram {
+    
+    // "WebRTC.Video.DecodeTimeInMs" などの名前
+    public var name: String
+    
+    public var min: Int
+    public var max: Int
+    public var bucketCount: Int
+    
+    // 値をキーとする標本の数
+    public var samples: [Int: Int]
+    
+    // 標本の数の合計
+    public var count: Int {
+        get { return samples.values.reduce(0, +) }
+    }
+    
+    public var mean: Double? {
+        get {
+            let count = self.count
+            guard count > 0 else { return nil }
+            var sum = 0.0
+            for (value, n) in samples {
+                sum += Double(value) * Double(n)
+            }
+            return sum / Double(count)
+        }
+    }
+    
+    init(info: RTCMetricsSampleInfo) {
+        name = info.name
+        min = Int(info.min)
+        max = Int(info.max)
+        bucketCount = Int(info.bucketCount)
+        samples = [:]
+        for (value, n) in info.samples {
+            samples[value.intValue] = n.intValue
+        }
+    }
+    
+    init(name: String, min: Int, max: Int, bucketCount: Int, samples: [Int: Int]) {
+        self.name = name
+        self.min = min
+        self.max = max
+        self.bucketCount = bucketCount
+        self.samples = samples
+    }
+    
+    // 標本の値の百分位数 (p は 0 から 1)
+    public func percentile(_ p: Double) -> Int? {
+        let count = self.count
+        guard count > 0 else { return nil }
+        let target = Swift.max(1, Int((Double(count) * p).rounded(.up)))
+        var accumulated = 0
+        for value in samples.keys.sorted() {
+            accumulated += samples[value]!
+            if accumulated >= target {
+                return value
+            }
+        }
+        return samples.keys.max()
+    }
+    
+    mutating func add(_ other: RTCMetricsHistogram) {
+        for (value, n) in other.samples {
+            samples[value] = (samples[value] ?? 0) + n
+        }
+    }
+    
+    // other からの標本の増分
+    func subtracting(_ other: RTCMetricsHistogram) -> RTCMetricsHistogram {
+        var delta = self
+        delta.samples = [:]
+        for (value, n) in samples {
+            let diff = n - (other.samples[value] ?? 0)
+            if diff > 0 {
+                delta.samples[value] = diff
+            }
+        }
+        return delta
+    }
+    
+    public func jsonObject() -> [String: Any] {
+        var json: [String: Any] = ["name": name,
+                                   "min": min,
+                                   "max": max,
+                                   "bucket_count": bucketCount,
+                                   "count": count]
+        var samplesJson: [String: Int] = [:]
+        for (value, n) in samples {
+            samplesJson[value.description] = n
+        }
+        json["samples"] = samplesJson
+        if let mean = mean {
+            json["mean"] = mean
+        }
+        if let p50 = percentile(0.5), let p95 = percentile(0.95) {
+            json["p50"] = p50
+            json["p95"] = p95
+        }
+        return json
+    }
+    
+}
+
+// ある時点までに WebRTC が記録したすべてのヒストグラム
+public struct RTCMetricsSnapshot {
+    
+    public var date: Date
+    
+    // 名前をキーとするヒストグラム
+    public var histograms: [String: RTCMetricsHistogram]
+    
+    // earlier の時点からの増分
+    // 標本が増えていないヒストグラムは含まない
+    public func delta(since earlier: RTCMetricsSnapshot) -> RTCMetricsSnapshot {
+        var delta: [String: RTCMetricsHistogram] = [:]
+        for (name, histogram) in histograms {
+            let diff: RTCMetricsHistogram
+            if let old = earlier.histograms[name] {
+                diff = histogram.subtracting(old)
+            } else {
+                diff = histogram
+            }
+            if !diff.samples.isEmpty {
+                delta[name] = diff
+            }
+        }
+        return RTCMetricsSnapshot(date: date, histograms: delta)
+    }
+    
+    public func jsonObject() -> [String: Any] {
+        return ["date": date.timeIntervalSince1970,
+                "histograms": histograms.keys.sorted().map {
+                    histograms[$0]!.jsonObject() }]
+    }
+    
+}
+
+// WebRTC のヒストグラムを累積する
+// RTCGetAndResetMetrics() は取得したヒストグラムを消去するので、
+// 取得は必ずこのクラスを通して行い、取得した標本を累積しておく
+// ヒストグラムはプロセスで 1 つなので、同時に複数の接続があれば標本は混ざる
+// スレッドセーフであり、どのスレッドからでも利用できる
+public final class RTCMetricsRecorder {
+    
+    public static let shared: RTCMetricsRecorder = RTCMetricsRecorder()
+    
+    let lock: NSLock = NSLock()
+    var cumulative: [String: RTCMetricsHistogram] = [:]
+    
+    init() {}
+    
+    // 現時点までの累積のヒストグラムを取得する
+    public func snapshot() -> RTCMetricsSnapshot {
+        // ヒストグラムの記録を有効にする
+        _ = PeerConnectionFactory.initializeOnce
+        
+        lock.lock()
+        defer { lock.unlock() }
+        for info in RTCGetAndResetMetrics() {
+            let histogram = RTCMetricsHistogram(info: info)
+            if cumulative[histogram.name] != nil {
+                cumulative[histogram.name]!.add(histogram)
+            } else {
+                cumulative[histogram.name] = histogram
+            }
+        }
+        return RTCMetricsSnapshot(date: Date(), histograms: cumulative)
+    }
+    
+}
+
+// 接続の段階ごとのヒストグラム
+public struct RTCMetricsPhase {
+    
+    // PeerConnection.State の値
+    public var name: String
+    
+    public var startDate: Date
+    public var endDate: Date
+    
+    // 段階の間に記録された標本
+    public var histograms: [String: RTCMetricsHistogram]
+    
+    public func jsonObject() -> [String: Any] {
+        return ["name": name,
+                "start": startDate.timeIntervalSince1970,
+                "end": endDate.timeIntervalSince1970,
+                "duration": endDate.timeIntervalSince(startDate),
+                "histograms": histograms.keys.sorted().map {
+                    histograms[$0]!.jsonObject() }]
+    }
+    
+}
+
+// 1 回の接続 (セッション) の間に記録されたヒストグラム
+// 接続の段階が変わるたびにスナップショットを取り、前回との差分を段階のヒストグラムとする
+// 接続の状態は WebRTC のスレッドでも変わるので、ロックして記録する
+// スレッドセーフであり、どのスレッドからでも利用できる
+public class RTCMetricsReport {
+    
+    public let startDate: Date
+    
+    public var endDate: Date? {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return finalSnapshot?.date
+        }
+    }
+    
+    // 終了した段階
+    public var phases: [RTCMetricsPhase] {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _phases
+        }
+    }
+    
+    // セッション全体のヒストグラム
+    // 終了するまでは現時点までの標本を返す
+    public var session: RTCMetricsSnapshot {
+        get {
+            lock.lock()
+            let final = finalSnapshot
+            lock.unlock()
+            let end = final ?? RTCMetricsRecorder.shared.snapshot()
+            return end.delta(since: startSnapshot)
+        }
+    }
+    
+    public var isFinished: Bool {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return finalSnapshot != nil
+        }
+    }
+    
+    let lock: NSLock = NSLock()
+    let startSnapshot: RTCMetricsSnapshot
+    var phaseSnapshot: RTCMetricsSnapshot
+    var phaseName: String
+    var finalSnapshot: RTCMetricsSnapshot?
+    var _phases: [RTCMetricsPhase] = []
+    
+    init(phase: String) {
+        startSnapshot = RTCMetricsRecorder.shared.snapshot()
+        startDate = startSnapshot.date
+        phaseSnapshot = startSnapshot
+        phaseName = phase
+    }
+    
+    // 現在の段階を終了して次の段階を始める
+    func beginPhase(_ name: String) {
+        lock.lock()
+        defer { lock.unlock() }
+        guard finalSnapshot == nil && name != phaseName else { return }
+        let snapshot = RTCMetricsRecorder.shared.snapshot()
+        endPhase(snapshot: snapshot)
+        phaseSnapshot = snapshot
+        phaseName = name
+    }
+    
+    func finish() {
+        lock.lock()
+        defer { lock.unlock() }
+        guard finalSnapshot == nil else { return }
+        let snapshot = RTCMetricsRecorder.shared.snapshot()
+        endPhase(snapshot: snapshot)
+        finalSnapshot = snapshot
+    }
+    
+    // ロックしてから呼ぶ
+    func endPhase(snapshot: RTCMetricsSnapshot) {
+        let delta = snapshot.delta(since: phaseSnapshot)
+        _phases.append(RTCMetricsPhase(name: phaseName,
+                                       startDate: phaseSnapshot.date,
+                                       endDate: snapshot.date,
+                                       histograms: delta.histograms))
+    }
+    
+    // MARK: JSON
+    
+    public func jsonObject() -> [String: Any] {
+        var json: [String: Any] = ["start": startDate.timeIntervalSince1970,
+                                   "phases": phases.map { $0.jsonObject() },
+                                   "session": session.jsonObject()]
+        if let endDate = endDate {
+            json["end"] = endDate.timeIntervalSince1970
+        }
+        var build: [String: Any] = [:]
+        if let version = BuildInfo.WebRTCVersion {
+            build["webrtc_version"] = version
+        }
+        if let revision = BuildInfo.WebRTCRevision {
+            build["webrtc_revision"] = revision
+        }
+        if let version = Bundle(for: RTCMetricsReport.self)
+            .object(forInfoDictionaryKey: "CFBundleShortVersionString") as? String
+        {
+            build["sdk_version"] = version
+        }
+        json["build"] = build
+        return json
+    }
+    
+    public func jsonData() throws -> Data {
+        return try JSONSerialization.data(withJSONObject: jsonObject(),
+                                          options: [.prettyPrinted])
+    }
+    
+}
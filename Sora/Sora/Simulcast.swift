@@ -0,0 +1,265 @@
+import Foundation
+import WebRTC
+
+// サイマルキャストで送信する映像の層
+// 層は解像度の低い順に並べる
+public struct SimulcastLayer {
+    
+    public var name: String
+    
+    // 最大ビットレート (kbps)
+    public var maxBitRate: Int
+    
+    // false であれば、この層を送信しない
+    public var isActive: Bool
+    
+    public init(name: String, maxBitRate: Int, isActive: Bool = true) {
+        self.name = name
+        self.maxBitRate = maxBitRate
+        self.isActive = isActive
+    }
+    
+    public static let low: SimulcastLayer =
+        SimulcastLayer(name: "low", maxBitRate: 150)
+    public static let middle: SimulcastLayer =
+        SimulcastLayer(name: "middle", maxBitRate: 500)
+    public static let high: SimulcastLayer =
+        SimulcastLayer(name: "high", maxBitRate: 1500)
+    
+    public static let defaultLayers: [SimulcastLayer] = [.low, .middle, .high]
+    
+}
+
+// Answer の映像の m セクションにサイマルキャストの SSRC を追加する
+// libwebrtc はローカルの SDP に "a=ssrc-group:SIM" があれば、
+// その SSRC の数の層を符号化して送信する
+// 再ネゴシエーションのたびに同じ SSRC を追加する必要があるので、生成した SSRC を保持する
+final class SimulcastAnswerModifier {
+    
+    let numberOfLayers: Int
+    var primarySSRC: UInt32?
+    var additionalSSRCs: [UInt32] = []
+    var additionalRtxSSRCs: [UInt32] = []
+    
+    init(numberOfLayers: Int) {
+        self.numberOfLayers = numberOfLayers
+    }
+    
+    func modify(_ sdp: String) -> String {
+        guard numberOfLayers > 1 else { return sdp }
+        var lines = sdp.components(separatedBy: "\r\n")
+        guard let start = lines.index(where: { $0.hasPrefix("m=video") }) else {
+            return sdp
+        }
+        var end = lines.count
+        for i in (start + 1)..<lines.count {
+            if lines[i].hasPrefix("m=") {
+                end = i
+                break
+            }
+        }
+        if end == lines.count && lines.last == "" {
+            end -= 1
+        }
+        let section = Array(lines[start..<end])
+        if section.contains(where: { $0.hasPrefix("a=ssrc-group:SIM") }) {
+            return sdp
+        }
+        
+        // 送信する映像の SSRC と、再送 (RTX) の SSRC
+        var primary: UInt32?
+        var rtx: UInt32?
+        for line in section {
+            if line.hasPrefix("a=ssrc-group:FID ") {
+                let ssrcs = parseSSRCs(line, prefix: "a=ssrc-group:FID ")
+                if ssrcs.count == 2 {
+                    primary = ssrcs[0]
+                    rtx = ssrcs[1]
+                    break
+                }
+            }
+        }
+        if primary == nil {
+            for line in section {
+                if line.hasPrefix("a=ssrc:") {
+                    primary = parseSSRCs(line, prefix: "a=ssrc:").first
+                    break
+                }
+            }
+        }
+        
+        // 送信する映像がない
+        guard let primarySSRC = primary else { return sdp }
+        
+        if self.primarySSRC != primarySSRC ||
+            (rtx != nil && additionalRtxSSRCs.isEmpty)
+        {
+            generateSSRCs(primary: primarySSRC, hasRtx: rtx != nil, sdp: sdp)
+        }
+        
+        var added: [String] = []
+        for (i, ssrc) in additionalSSRCs.enumerated() {
+            added += copyAttributes(of: primarySSRC, to: ssrc, in: section)
+            if let rtx = rtx {
+                let rtxSSRC = additionalRtxSSRCs[i]
+                added += copyAttributes(of: rtx, to: rtxSSRC, in: section)
+                added.append("a=ssrc-group:FID \(ssrc) \(rtxSSRC)")
+            }
+        }
+        let group = ([primarySSRC] + additionalSSRCs).map { String($0) }
+        added.append("a=ssrc-group:SIM " + group.joined(separator: " "))
+        lines.insert(contentsOf: added, at: end)
+        return lines.joined(separator: "\r\n")
+    }
+    
+    func parseSSRCs(_ line: String, prefix: String) -> [UInt32] {
+        let body = line.substring(from: line.index(line.startIndex,
+                                                   offsetBy: prefix.characters.count))
+        var ssrcs: [UInt32] = []
+        for token in body.components(separatedBy: " ") {
+            guard let ssrc = UInt32(token) else { break }
+            ssrcs.append(ssrc)
+        }
+        return ssrcs
+    }
+    
+    func copyAttributes(of ssrc: UInt32, to newSSRC: UInt32,
+                        in section: [String]) -> [String] {
+        let prefix = "a=ssrc:\(ssrc) "
+        var copied: [String] = []
+        for line in section {
+            if line.hasPrefix(prefix) {
+                let attr = line.substring(from: line.index(line.startIndex,
+                                                           offsetBy: prefix.characters.count))
+                copied.append("a=ssrc:\(newSSRC) " + attr)
+            }
+        }
+        return copied
+    }
+    
+    func generateSSRCs(primary: UInt32, hasRtx: Bool, sdp: String) {
+        var used: Set<UInt32> = [primary]
+        func generate() -> UInt32 {
+            while true {
+                let ssrc = arc4random()
+                if ssrc != 0 && !used.contains(ssrc) &&
+                    !sdp.contains("a=ssrc:\(ssrc) ")
+                {
+                    used.insert(ssrc)
+                    return ssrc
+                }
+            }
+        }
+        
+        primarySSRC = primary
+        additionalSSRCs = (1..<numberOfLayers).map { _ in generate() }
+        additionalRtxSSRCs = hasRtx ?
+            (1..<numberOfLayers).map { _ in generate() } : []
+    }
+    
+}
+
+extension PeerConnectionContext {
+    
+    var videoSenders: [RTCRtpSender] {
+        get {
+            guard let native = nativePeerConnection else { return [] }
+            return native.senders.filter {
+                $0.track?.kind == kRTCMediaStreamTrackKindVideo
+            }
+        }
+    }
+    
+    // サイマルキャストが有効であれば Answer に SSRC を追加する
+    func modifyAnswerForSimulcast(_ sdp: RTCSessionDescription) -> RTCSessionDescription {
+        guard let modifier = simulcastAnswerModifier else { return sdp }
+        let modified = modifier.modify(sdp.sdp)
+        guard modified != sdp.sdp else { return sdp }
+        eventLog?.markFormat(type: .PeerConnection,
+                             format: "add simulcast SSRCs (%d layers)",
+                             arguments: modifier.numberOfLayers)
+        return RTCSessionDescription(type: sdp.type, sdp: modified)
+    }
+    
+    // 層ごとに送信パラメーターを設定できるかどうか
+    // WebRTC M57 はエンコーディングを 1 つしか返さないので設定できない
+    // 映像の送信を始めていなければ判断できないので true を返す
+    var canSetSimulcastEncodingsPerLayer: Bool {
+        get {
+            guard let layers = peerConnection?.mediaOption.simulcastLayers else {
+                return true
+            }
+            return videoSenders.reduce(true) {
+                $0 && $1.parameters.encodings.count == layers.count
+            }
+        }
+    }
+    
+    // 層の設定を反映できるかどうか
+    // 層ごとに設定できなければ、有効な層が最も低い層から途切れずに続いている必要がある
+    // (ビットレートの合計の上限で層を減らすので、低い層だけを止められない)
+    func canApplySimulcastLayers(_ layers: [SimulcastLayer]) -> Bool {
+        guard !canSetSimulcastEncodingsPerLayer else { return true }
+        guard let first = layers.first, first.isActive else { return false }
+        let numberOfActiveLayers = layers.filter { $0.isActive }.count
+        return layers.prefix(numberOfActiveLayers).reduce(true) { $0 && $1.isActive }
+    }
+    
+    // 映像の送信パラメーターに層の設定を反映する
+    // RTCRtpSender.parameters は取得するたびにコピーが返るので、変更したら設定し直す
+    // 帯域不足で映像の送信を止めている間 (isVideoSuppressed) は、すべての層を無効のままにする
+    // (isActive は VideoFallbackController の判断を優先する)
+    func updateSimulcastEncodings() {
+        guard let option = peerConnection?.mediaOption,
+            option.simulcastEnabled else { return }
+        let layers = option.simulcastLayers
+        guard !layers.isEmpty else { return }
+        
+        for sender in videoSenders {
+            let parameters = sender.parameters
+            let encodings = parameters.encodings
+            if encodings.count == layers.count {
+                for (encoding, layer) in zip(encodings, layers) {
+                    encoding.isActive = layer.isActive
+                    encoding.maxBitrateBps = NSNumber(value: layer.maxBitRate * 1000)
+                }
+            } else {
+                // 層ごとのパラメーターを設定できない場合は、
+                // 低い層から続けて有効な層の最大ビットレートの合計を全体の上限にする
+                // ビットレートは低い層から割り当てられるので、
+                // 上位の層を無効にすると、その層に割り当てるビットレートがなくなり送信されない
+                // 低い層は止められないので、最も低い層が無効でも最も低い層は送信する
+                var total = 0
+                for layer in layers {
+                    guard layer.isActive else { break }
+                    total += layer.maxBitRate
+                }
+                if total == 0 {
+                    eventLog?.markFormat(type: .PeerConnection,
+                                         format: "cannot deactivate the lowest simulcast layer")
+                    total = layers[0].maxBitRate
+                }
+                for encoding in encodings {
+                    encoding.isActive = true
+                    encoding.maxBitrateBps = NSNumber(value: total * 1000)
+                }
+            }
+            if isVideoSuppressed {
+                for encoding in encodings {
+                    encoding.isActive = false
+                }
+            }
+            sender.parameters = parameters
+            
+            let desc = layers.map {
+                layer in
+                "\(layer.name)=\(layer.isActive ? layer.maxBitRate : 0)"
+                }.joined(separator: ",")
+            eventLog?.markFormat(type: .PeerConnection,
+                                 format: "set simulcast encodings (%d encodings): %@%@",
+                                 arguments: encodings.count, desc,
+                                 isVideoSuppressed ? " (video suppressed)" : "")
+        }
+    }
+    
+}
@@ -18,54 +18,88 @@ public class Snapshot {
     public var bitmapImage: CGImage!
     public var drawnImage: UIImage!
     
+    // 段階的なデコードの途中で生成されたスナップショットであれば true
+    public var isPartial: Bool = false
+    
+    // デコード済みの行数
+    // 段階的なデコードの途中であれば画像の高さより小さい
+    public var numberOfDecodedRows: Int = 0
+    
     init(base64Encoded: String) throws {
         guard let data = Data(base64Encoded: base64Encoded) else {
             throw SnapshotError.invalidBase64Format
         }
         let image = try Snapshot.decode(data: data)
+        self.data = data
         self.bitmapImage = image.0
         self.drawnImage = image.1
+        self.numberOfDecodedRows = image.0.height
     }
     
     init(data: Data) throws {
         let image = try Snapshot.decode(data: data)
+        self.data = data
         self.bitmapImage = image.0
         self.drawnImage = image.1
+        self.numberOfDecodedRows = image.0.height
+    }
+    
+    init(bitmapImage: CGImage, drawnImage: UIImage,
+         isPartial: Bool, numberOfDecodedRows: Int) {
+        self.bitmapImage = bitmapImage
+        self.drawnImage = drawnImage
+        self.isPartial = isPartial
+        self.numberOfDecodedRows = numberOfDecodedRows
     }
     
+    // デコード先のバッファはプールから借りる
+    // バッファは CGImage が解放されるまでプールに返却されない
     static func decode(data: Data) throws -> (CGImage, UIImage) {
         let len = data.count
-        let buf = UnsafeMutablePointer<UInt8>.allocate(capacity: len)
-        data.copyBytes(to: buf, count: len)
-
-        let widthBuf = UnsafeMutablePointer<Int32>.allocate(capacity: 1)
-        let heightBuf = UnsafeMutablePointer<Int32>.allocate(capacity: 1)
-        let decodedOpt = WebPDecodeARGB(buf, len, widthBuf, heightBuf)
-        let width = Int(widthBuf.pointee)
-        let height = Int(heightBuf.pointee)
-        
-        buf.deallocate(capacity: len)
-        widthBuf.deallocate(capacity: 1)
-        heightBuf.deallocate(capacity: 1)
-        guard let decoded = decodedOpt else {
+        var width: Int32 = 0
+        var height: Int32 = 0
+        let isValid = data.withUnsafeBytes {
+            (bytes: UnsafePointer<UInt8>) -> Bool in
+            return WebPGetInfo(bytes, len, &width, &height) != 0
+        }
+        guard isValid && width > 0 && height > 0 else {
             throw SnapshotError.WebPDecodeFailed
         }
         
-        let providerOpt = CGDataProvider(dataInfo: nil,
-                                         data: decoded,
-                                         size: width * height * 4) {
-                                            _, _, _ in return
+        let buffer = VideoFrameBufferPool.shared.lease(width: Int(width),
+                                                       height: Int(height),
+                                                       format: .RGB32)
+        let output = buffer.data.assumingMemoryBound(to: UInt8.self)
+        let decodedOpt = data.withUnsafeBytes {
+            (bytes: UnsafePointer<UInt8>) -> UnsafeMutablePointer<UInt8>? in
+            return WebPDecodeARGBInto(bytes, len, output, buffer.count,
+                                      Int32(buffer.bytesPerRow))
+        }
+        guard decodedOpt != nil else {
+            throw SnapshotError.WebPDecodeFailed
         }
-        guard let provider = providerOpt else {
+        
+        guard let provider = buffer.createDataProvider() else {
             throw SnapshotError.dataProviderInitFailed
         }
         
+        let bitmapImage = try createBitmapImage(provider: provider,
+                                                width: buffer.width,
+                                                height: buffer.height,
+                                                bytesPerRow: buffer.bytesPerRow)
+        return (bitmapImage, try draw(bitmapImage: bitmapImage))
+    }
+    
+    static func createBitmapImage(provider: CGDataProvider,
+                                  width: Int,
+                                  height: Int,
+                                  bytesPerRow: Int) throws -> CGImage {
         let bitmapImageOpt =
             CGImage(width: width,
                     height: height,
                     bitsPerComponent: 8,
                     bitsPerPixel: 32,
-                    bytesPerRow: width * 4,
+                    bytesPerRow: bytesPerRow,
                     space: CGColorSpaceCreateDeviceRGB(),
                     bitmapInfo: CGBitmapInfo.byteOrder32Little,
                     provider: provider,
@@ -75,7 +109,10 @@ public class Snapshot {
         guard let bitmapImage = bitmapImageOpt else {
             throw SnapshotError.bitmapImageCreateFailed
         }
-        
+        return bitmapImage
+    }
+    
+    static func draw(bitmapImage: CGImage) throws -> UIImage {
         let image = UIImage(cgImage: bitmapImage)
         UIGraphicsBeginImageContext(image.size)
         guard let context = UIGraphicsGetCurrentContext() else {
@@ -93,11 +130,147 @@ public class Snapshot {
                    height: image.size.height))
         
         guard let rotated = UIGraphicsGetImageFromCurrentImageContext() else {
+            UIGraphicsEndImageContext()
             throw SnapshotError.drawnImageCreateFailed
         }
         UIGraphicsEndImageContext()
         
-        return (bitmapImage, rotated)
+        return rotated
+    }
+    
+}
+
+// WebP 画像を分割して受け取り、段階的にデコードする
+// libwebp の WebPIDecoder を使う
+class IncrementalSnapshotDecoder {
+    
+    // 途中経過のスナップショットを生成する行数の最小間隔 (画像の高さに対する割合)
+    static var defaultPublishingInterval: Double = 0.125
+    
+    var decoder: OpaquePointer?
+    var publishingInterval: Double
+    var lastPublishedRow: Int = 0
+    var isCompleted: Bool = false
+    
+    init(publishingInterval: Double =
+        IncrementalSnapshotDecoder.defaultPublishingInterval) throws {
+        self.publishingInterval = publishingInterval
+        // 出力バッファはデコーダー側で確保する
+        decoder = WebPINewRGB(MODE_ARGB, nil, 0, 0)
+        if decoder == nil {
+            throw SnapshotError.WebPDecodeFailed
+        }
+    }
+    
+    deinit {
+        if let decoder = decoder {
+            WebPIDelete(decoder)
+        }
+    }
+    
+    // データを追加してデコードする
+    // 前回から一定以上の行がデコードされていれば途中経過のスナップショットを返す
+    // 画像全体のデコードが完了したら isCompleted が true になる
+    func append(data: Data) throws -> Snapshot? {
+        guard let decoder = decoder, !isCompleted else {
+            return nil
+        }
+        
+        let status = data.withUnsafeBytes {
+            (bytes: UnsafePointer<UInt8>) -> VP8StatusCode in
+            return WebPIAppend(decoder, bytes, data.count)
+        }
+        switch status {
+        case VP8_STATUS_OK:
+            isCompleted = true
+            return try currentSnapshot(force: true)
+        case VP8_STATUS_SUSPENDED:
+            return try currentSnapshot(force: false)
+        default:
+            throw SnapshotError.WebPDecodeFailed
+        }
+    }
+    
+    func currentSnapshot(force: Bool) throws -> Snapshot? {
+        var lastY: Int32 = 0
+        var width: Int32 = 0
+        var height: Int32 = 0
+        var stride: Int32 = 0
+        guard let decoded = WebPIDecGetRGB(decoder, &lastY,
+                                           &width, &height, &stride) else {
+            // ヘッダーの受信前
+            return nil
+        }
+        
+        let rows = Int(lastY)
+        let minRows = max(1, Int(Double(height) * publishingInterval))
+        guard rows > 0 else { return nil }
+        guard force || rows - lastPublishedRow >= minRows else { return nil }
+        lastPublishedRow = rows
+        
+        // デコーダーの出力バッファは以降のデコードで書き換えられるので、
+        // デコード済みの行をプールから借りたバッファにコピーする
+        // 未デコードの行は 0 で埋める (ビットマップはアルファを持たないので黒く描画される)
+        let bytesPerRow = Int(stride)
+        let buffer = VideoFrameBufferPool.shared.lease(width: bytesPerRow / 4,
+                                                       height: Int(height),
+                                                       format: .RGB32)
+        let decodedSize = bytesPerRow * rows
+        buffer.data.copyBytes(from: decoded, count: decodedSize)
+        memset(buffer.data + decodedSize, 0, buffer.count - decodedSize)
+        guard let provider = buffer.createDataProvider() else {
+            throw SnapshotError.dataProviderInitFailed
+        }
+        let bitmapImage = try Snapshot
+            .createBitmapImage(provider: provider,
+                               width: Int(width),
+                               height: Int(height),
+                               bytesPerRow: bytesPerRow)
+        let drawnImage = try Snapshot.draw(bitmapImage: bitmapImage)
+        return Snapshot(bitmapImage: bitmapImage,
+                        drawnImage: drawnImage,
+                        isPartial: rows < Int(height),
+                        numberOfDecodedRows: rows)
+    }
+    
+    // Base64 でエンコードされた WebP 画像を分割してデコードする
+    // 文字列全体をデコードしたバイト列を保持しないので、
+    // デコード中のメモリの使用量を抑えられる
+    // 途中経過のスナップショットはハンドラに渡され、
+    // 最後にデコードを完了したスナップショットを返す
+    static func decode(base64Encoded: String,
+                       chunkSize: Int,
+                       publishingInterval: Double =
+        IncrementalSnapshotDecoder.defaultPublishingInterval,
+                       handler: (Snapshot) -> Void) throws -> Snapshot {
+        let decoder = try IncrementalSnapshotDecoder(publishingInterval:
+            publishingInterval)
+        
+        // Base64 は 4 文字単位でデコードする必要がある
+        let base64 = base64Encoded as NSString
+        let step = max(4, chunkSize - chunkSize % 4)
+        var location = 0
+        var last: Snapshot?
+        while location < base64.length && !decoder.isCompleted {
+            let length = min(step, base64.length - location)
+            let chunk = base64.substring(with: NSRange(location: location,
+                                                       length: length))
+            location += length
+            guard let data = Data(base64Encoded: chunk) else {
+                throw SnapshotError.invalidBase64Format
+            }
+            if let snapshot = try decoder.append(data: data) {
+                last = snapshot
+                if snapshot.isPartial {
+                    handler(snapshot)
+                }
+            }
+        }
+        
+        guard decoder.isCompleted, let snapshot = last else {
+            throw SnapshotError.WebPDecodeFailed
+        }
+        return snapshot
     }
     
 }
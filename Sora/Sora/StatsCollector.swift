@@ -0,0 +1,504 @@
+import Foundation
+import WebRTC
+
+// RTP ストリームの向き
+public enum RTPStreamDirection: String {
+    case send
+    case receive
+}
+
+// RTP ストリーム (SSRC) の 1 回分の統計
+// WebRTC の統計レポート (RTCLegacyStatsReport) の文字列の値を型付きの値に変換したもの
+public struct RTPStreamStats {
+    
+    // 統計を取得した時刻 (1970 年 1 月 1 日からの秒数)
+    public var timestamp: TimeInterval
+    
+    public var ssrc: String
+    public var trackId: String?
+    
+    // "audio" または "video"
+    public var mediaType: String
+    
+    public var direction: RTPStreamDirection
+    public var codecName: String?
+    
+    // 送信または受信したバイト数とパケット数 (累計)
+    public var bytes: Int = 0
+    public var packets: Int = 0
+    
+    // 失われたパケットの数 (累計)
+    // 送信では相手の受信レポートによる
+    public var packetsLost: Int = 0
+    
+    // RTT (秒)
+    public var roundTripTime: TimeInterval?
+    
+    // 到着間隔の揺らぎ (秒)
+    // 音声のみ
+    public var jitter: TimeInterval?
+    
+    // 映像のフレーム数 (累計)
+    // 送信では符号化したフレーム数、受信では復号したフレーム数
+    public var framesEncoded: Int?
+    public var framesDecoded: Int?
+    
+    // 受信したが復号しなかったフレームの数 (累計)
+    public var framesDropped: Int?
+    
+    public var frameWidth: Int?
+    public var frameHeight: Int?
+    
+    // 送信する映像の、キャプチャーから入力されたフレームレートと送信したフレームレート
+    public var inputFrameRate: Double?
+    public var sentFrameRate: Double?
+    
+    // 符号化にかかった時間のフレーム間隔に対する割合 (0 から 1)
+    // 送信する映像のみ
+    public var encodeUsage: Double?
+    
+    // 以下は前回の統計との差分から求める
+    
+    // ビットレート (bps)
+    public var bitRate: Double = 0
+    
+    // パケットロス率 (0 から 1)
+    public var packetLossRate: Double = 0
+    
+    // 映像のフレームレート (送信では符号化、受信では復号)
+    public var frameRate: Double?
+    
+    init(timestamp: TimeInterval, ssrc: String, mediaType: String,
+         direction: RTPStreamDirection) {
+        self.timestamp = timestamp
+        self.ssrc = ssrc
+        self.mediaType = mediaType
+        self.direction = direction
+    }
+    
+}
+
+// 帯域推定の統計
+public struct BandwidthStats {
+    
+    public var timestamp: TimeInterval
+    
+    // 帯域推定による送信・受信可能なビットレート (bps)
+    public var availableSendBitRate: Int?
+    public var availableReceiveBitRate: Int?
+    
+    // 符号化したビットレートと、再送などを含めて送信したビットレート (bps)
+    public var actualEncodedBitRate: Int?
+    public var transmitBitRate: Int?
+    
+}
+
+// RTP ストリームの統計の履歴
+// 一定の数の統計を環状バッファに保持し、古い統計は上書きする
+// 平均値は追加と上書きのたびに合計を更新して求め、履歴を走査しない
+public struct RTPStreamStatsHistory {
+    
+    public let capacity: Int
+    
+    public var count: Int {
+        get { return buffer.count }
+    }
+    
+    // 最新の統計
+    public var last: RTPStreamStats? {
+        get {
+            guard !buffer.isEmpty else { return nil }
+            return buffer[(head + buffer.count - 1) % buffer.count]
+        }
+    }
+    
+    // 古い順の統計
+    public var samples: [RTPStreamStats] {
+        get {
+            guard buffer.count == capacity else { return buffer }
+            return Array(buffer[head..<buffer.count]) + Array(buffer[0..<head])
+        }
+    }
+    
+    // 履歴の期間のビットレートとパケットロス率の平均
+    public var averageBitRate: Double {
+        get {
+            guard !buffer.isEmpty else { return 0 }
+            return totalBitRate / Double(buffer.count)
+        }
+    }
+    
+    public var averagePacketLossRate: Double {
+        get {
+            guard !buffer.isEmpty else { return 0 }
+            return totalPacketLossRate / Double(buffer.count)
+        }
+    }
+    
+    var buffer: [RTPStreamStats] = []
+    
+    // 最も古い統計の位置 (バッファが一杯になってから使う)
+    var head: Int = 0
+    
+    var totalBitRate: Double = 0
+    var totalPacketLossRate: Double = 0
+    
+    init(capacity: Int) {
+        self.capacity = max(1, capacity)
+        buffer.reserveCapacity(self.capacity)
+    }
+    
+    // 前回の統計との差分を求めてから追加する
+    mutating func append(_ stats: RTPStreamStats) {
+        var stats = stats
+        if let prev = last {
+            stats.computeRates(since: prev)
+        }
+        
+        if buffer.count < capacity {
+            buffer.append(stats)
+        } else {
+            let old = buffer[head]
+            totalBitRate -= old.bitRate
+            totalPacketLossRate -= old.packetLossRate
+            buffer[head] = stats
+            head = (head + 1) % capacity
+        }
+        totalBitRate += stats.bitRate
+        totalPacketLossRate += stats.packetLossRate
+    }
+    
+}
+
+extension RTPStreamStats {
+    
+    mutating func computeRates(since prev: RTPStreamStats) {
+        let elapsed = timestamp - prev.timestamp
+        guard elapsed > 0 else { return }
+        
+        // 統計がリセットされた場合は差分を求めない
+        let bytesDelta = bytes - prev.bytes
+        if bytesDelta >= 0 {
+            bitRate = Double(bytesDelta) * 8 / elapsed
+        }
+        
+        let lostDelta = packetsLost - prev.packetsLost
+        let packetsDelta = packets - prev.packets
+        if lostDelta > 0 && packetsDelta >= 0 {
+            // 送信ではパケット数に失われたパケットを含み、受信では含まない
+            let total = direction == .send ?
+                packetsDelta : packetsDelta + lostDelta
+            if total > 0 {
+                packetLossRate = min(1, Double(lostDelta) / Double(total))
+            }
+        }
+        
+        let frames = direction == .send ? framesEncoded : framesDecoded
+        let prevFrames = direction == .send ? prev.framesEncoded : prev.framesDecoded
+        if let frames = frames, let prevFrames = prevFrames, frames >= prevFrames {
+            frameRate = Double(frames - prevFrames) / elapsed
+        }
+    }
+    
+}
+
+// 一定の間隔で WebRTC の統計を取得し、型付きの統計と履歴を保持する
+// 統計の取得と変換はメインスレッド以外で行う
+// 統計の参照はどのスレッドからでもできる
+public class StatsCollector {
+    
+    // 統計を取得する間隔 (秒)
+    // 変更は次に start() を呼んだときに反映される
+    public var interval: TimeInterval = 1
+    
+    // ストリームごとに保持する統計の数
+    // 変更は新しいストリームから反映される
+    public var historyCapacity: Int = 60
+    
+    public var isRunning: Bool {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return timer != nil
+        }
+    }
+    
+    // 統計を取得した回数
+    public var numberOfCollections: Int {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _numberOfCollections
+        }
+    }
+    
+    // 最新の帯域推定の統計
+    public var bandwidth: BandwidthStats? {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _bandwidth
+        }
+    }
+    
+    // トラック ID (なければ SSRC) をキーとする履歴
+    // 最新のレポートに含まれないストリームの履歴は取り除く
+    public var histories: [String: RTPStreamStatsHistory] {
+        get {
+            lock.lock()
+            defer { lock.unlock() }
+            return _histories
+        }
+    }
+    
+    static let queue: DispatchQueue =
+        DispatchQueue(label: "jp.shiguredo.Sora.stats", qos: .utility)
+    
+    weak var context: PeerConnectionContext?
+    let lock: NSLock = NSLock()
+    var timer: DispatchSourceTimer?
+    var isCollecting: Bool = false
+    var _numberOfCollections: Int = 0
+    var _bandwidth: BandwidthStats?
+    var _histories: [String: RTPStreamStatsHistory] = [:]
+    
+    var onUpdateHandler: ((StatsCollector) -> Void)?
+    
+    // SDK の内部で統計を利用する処理
+    // 登録した順に呼ぶ。同じキーで登録すると置き換える
+    enum InternalUpdateHandlerKey {
+        case adaptiveBitrate
+        case qualityEstimation
+        case videoFallback
+        case publishingQuality
+    }
+    
+    var _internalUpdateHandlers: [(key: InternalUpdateHandlerKey,
+                                   handler: (StatsCollector) -> Void)] = []
+    
+    init(context: PeerConnectionContext) {
+        self.context = context
+    }
+    
+    deinit {
+        timer?.cancel()
+    }
+    
+    // 統計を取得するたびに呼ばれるハンドラ
+    // ハンドラはメインスレッドで呼ばれる
+    public func onUpdate(handler: @escaping (StatsCollector) -> Void) {
+        onUpdateHandler = handler
+    }
+    
+    // 終了処理はメインスレッド以外からも呼ばれるので、ロックして操作する
+    func addInternalUpdateHandler(key: InternalUpdateHandlerKey,
+                                  handler: @escaping (StatsCollector) -> Void) {
+        lock.lock()
+        defer { lock.unlock() }
+        _internalUpdateHandlers = _internalUpdateHandlers.filter { $0.key != key }
+        _internalUpdateHandlers.append((key, handler))
+    }
+    
+    func removeInternalUpdateHandler(key: InternalUpdateHandlerKey) {
+        lock.lock()
+        defer { lock.unlock() }
+        _internalUpdateHandlers = _internalUpdateHandlers.filter { $0.key != key }
+    }
+    
+    public func history(forTrackId trackId: String) -> RTPStreamStatsHistory? {
+        lock.lock()
+        defer { lock.unlock() }
+        return _histories[trackId]
+    }
+    
+    // 最新の統計の一覧
+    public func latestStats(mediaType: String? = nil,
+                            direction: RTPStreamDirection? = nil) -> [RTPStreamStats] {
+        lock.lock()
+        defer { lock.unlock() }
+        var result: [RTPStreamStats] = []
+        for (_, history) in _histories {
+            guard let last = history.last else { continue }
+            if let mediaType = mediaType, last.mediaType != mediaType {
+                continue
+            }
+            if let direction = direction, last.direction != direction {
+                continue
+            }
+            result.append(last)
+        }
+        return result
+    }
+    
+    // MARK: 統計の取得
+    
+    public func start() {
+        lock.lock()
+        defer { lock.unlock() }
+        guard timer == nil else { return }
+        context?.eventLog?.markFormat(type: .PeerConnection,
+                                      format: "start stats collector (interval %f)",
+                                      arguments: interval)
+        let timer = DispatchSource.makeTimerSource(queue: StatsCollector.queue)
+        timer.scheduleRepeating(deadline: .now() + interval,
+                                interval: interval,
+                                leeway: .milliseconds(100))
+        timer.setEventHandler {
+            [weak self] in
+            self?.collect()
+        }
+        timer.resume()
+        self.timer = timer
+    }
+    
+    public func stop() {
+        lock.lock()
+        defer { lock.unlock() }
+        guard let timer = timer else { return }
+        context?.eventLog?.markFormat(type: .PeerConnection,
+                                      format: "stop stats collector")
+        timer.cancel()
+        self.timer = nil
+    }
+    
+    // 履歴を消去する
+    public func removeAll() {
+        lock.lock()
+        _histories = [:]
+        _bandwidth = nil
+        lock.unlock()
+    }
+    
+    // 前回の取得が完了していなければ何もしない
+    func collect() {
+        guard !isCollecting,
+            let native = context?.nativePeerConnection else { return }
+        isCollecting = true
+        native.stats(for: nil, statsOutputLevel: .standard) {
+            [weak self] reports in
+            StatsCollector.queue.async {
+                guard let weakSelf = self else { return }
+                weakSelf.isCollecting = false
+                guard weakSelf.isRunning else { return }
+                weakSelf.record(reports: reports)
+                DispatchQueue.main.async {
+                    weakSelf.lock.lock()
+                    let handlers = weakSelf._internalUpdateHandlers
+                    weakSelf.lock.unlock()
+                    for (_, handler) in handlers {
+                        handler(weakSelf)
+                    }
+                    weakSelf.onUpdateHandler?(weakSelf)
+                }
+            }
+        }
+    }
+    
+    func record(reports: [RTCLegacyStatsReport]) {
+        var parsed: [RTPStreamStats] = []
+        var bandwidth: BandwidthStats?
+        for report in reports {
+            switch report.type {
+            case "ssrc":
+                if let stats = StatsCollector.parseSSRC(report) {
+                    parsed.append(stats)
+                }
+            case "VideoBwe":
+                bandwidth = StatsCollector.parseBandwidth(report)
+            default:
+                break
+            }
+        }
+        
+        lock.lock()
+        var histories: [String: RTPStreamStatsHistory] = [:]
+        for stats in parsed {
+            let key = stats.trackId ?? stats.ssrc
+            var history = histories[key] ?? _histories[key] ??
+                RTPStreamStatsHistory(capacity: historyCapacity)
+            history.append(stats)
+            histories[key] = history
+        }
+        // 終了したストリームの古い統計を latestStats で返さないように、
+        // 最新のレポートに含まれない履歴は残さない
+        _histories = histories
+        if bandwidth != nil {
+            _bandwidth = bandwidth
+        }
+        _numberOfCollections += 1
+        lock.unlock()
+    }
+    
+    // MARK: レポートの変換
+    
+    static func parseSSRC(_ report: RTCLegacyStatsReport) -> RTPStreamStats? {
+        let values = report.values
+        guard let ssrc = values["ssrc"],
+            let mediaType = values["mediaType"] else { return nil }
+        
+        let direction: RTPStreamDirection
+        if values["bytesSent"] != nil {
+            direction = .send
+        } else if values["bytesReceived"] != nil {
+            direction = .receive
+        } else {
+            return nil
+        }
+        
+        func int(_ key: String) -> Int? {
+            return values[key].flatMap { Int($0) }
+        }
+        
+        func milliseconds(_ key: String) -> TimeInterval? {
+            return values[key].flatMap { Double($0) }.map { $0 / 1000 }
+        }
+        
+        var stats = RTPStreamStats(timestamp: report.timestamp / 1000,
+                                   ssrc: ssrc,
+                                   mediaType: mediaType,
+                                   direction: direction)
+        stats.trackId = values["googTrackId"]
+        stats.codecName = values["googCodecName"]
+        stats.packetsLost = max(0, int("packetsLost") ?? 0)
+        switch direction {
+        case .send:
+            stats.bytes = int("bytesSent") ?? 0
+            stats.packets = int("packetsSent") ?? 0
+            stats.framesEncoded = int("framesEncoded")
+            stats.frameWidth = int("googFrameWidthSent")
+            stats.frameHeight = int("googFrameHeightSent")
+            stats.inputFrameRate = values["googFrameRateInput"].flatMap { Double($0) }
+            stats.sentFrameRate = values["googFrameRateSent"].flatMap { Double($0) }
+            stats.encodeUsage = values["googEncodeUsagePercent"]
+                .flatMap { Double($0) }.map { $0 / 100 }
+        case .receive:
+            stats.bytes = int("bytesReceived") ?? 0
+            stats.packets = int("packetsReceived") ?? 0
+            stats.framesDecoded = int("framesDecoded")
+            if let received = int("googFramesReceived"),
+                let decoded = stats.framesDecoded {
+                stats.framesDropped = max(0, received - decoded)
+            }
+            stats.frameWidth = int("googFrameWidthReceived")
+            stats.frameHeight = int("googFrameHeightReceived")
+        }
+        if let rtt = milliseconds("googRtt"), rtt > 0 {
+            stats.roundTripTime = rtt
+        }
+        stats.jitter = milliseconds("googJitterReceived")
+        return stats
+    }
+    
+    static func parseBandwidth(_ report: RTCLegacyStatsReport) -> BandwidthStats {
+        let values = report.values
+        func int(_ key: String) -> Int? {
+            return values[key].flatMap { Int($0) }
+        }
+        return BandwidthStats(timestamp: report.timestamp / 1000,
+                              availableSendBitRate: int("googAvailableSendBandwidth"),
+                              availableReceiveBitRate: int("googAvailableReceiveBandwidth"),
+                              actualEncodedBitRate: int("googActualEncBitrate"),
+                              transmitBitRate: int("googTransmitBitrate"))
+    }
+    
+}
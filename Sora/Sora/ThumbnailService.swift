@@ -0,0 +1,266 @@
+import Foundation
+import UIKit
+import WebRTC
+import WebP
+
+// メディアストリームの映像から定期的にサムネイルを生成する
+// 自分が配信するストリームと受信したストリームのどちらにも使える
+// フレームの縮小と WebP へのエンコードは優先度の低いキューで行い、
+// CPU の使用率が cpuBudget を超えないようにサンプリングの間隔を空ける
+public class ThumbnailService {
+    
+    public weak var mediaStream: MediaStream?
+    
+    // サンプリングの間隔 (秒)
+    public var timeInterval: TimeInterval = 5.0
+    
+    // サムネイルの長辺のピクセル数
+    public var maxPixelSize: Int = 160
+    
+    // WebP の品質 (0-100)
+    public var quality: Float = 50
+    
+    // サムネイルの生成に使う CPU 時間の上限 (1 コアに対する割合)
+    public var cpuBudget: Double = 0.02
+    
+    public private(set) var isRunning: Bool = false
+    
+    // 生成したサムネイルの数
+    public var numberOfThumbnails: Int {
+        get { return sampler.numberOfThumbnails }
+    }
+    
+    // CPU 時間の上限のためにサンプリングを見送った回数
+    public var numberOfSkippedSamples: Int {
+        get { return sampler.numberOfSkippedSamples }
+    }
+    
+    var sampler: ThumbnailSampler!
+    
+    var eventLog: EventLog? {
+        get { return mediaStream?.eventLog }
+    }
+    
+    static var queue: DispatchQueue =
+        DispatchQueue(label: "jp.shiguredo.Sora.thumbnail", qos: .background)
+    
+    public init(mediaStream: MediaStream) {
+        self.mediaStream = mediaStream
+        sampler = ThumbnailSampler(service: self)
+    }
+    
+    deinit {
+        stop()
+    }
+    
+    // サムネイルの生成を開始する
+    // ハンドラはメインスレッドで呼ばれる
+    public func start(handler: @escaping (Snapshot) -> Void) {
+        guard !isRunning else { return }
+        guard let videoTrack = mediaStream?.nativeVideoTrack else {
+            eventLog?.markFormat(type: .MediaStream,
+                                 format: "thumbnail: video track not found")
+            return
+        }
+        eventLog?.markFormat(type: .MediaStream,
+                             format: "thumbnail: start (interval %f)",
+                             arguments: timeInterval)
+        sampler.configure(timeInterval: timeInterval,
+                          maxPixelSize: maxPixelSize,
+                          quality: quality,
+                          cpuBudget: cpuBudget,
+                          handler: handler)
+        videoTrack.add(sampler)
+        isRunning = true
+    }
+    
+    public func stop() {
+        guard isRunning else { return }
+        eventLog?.markFormat(type: .MediaStream, format: "thumbnail: stop")
+        mediaStream?.nativeVideoTrack?.remove(sampler)
+        sampler.configure(timeInterval: timeInterval,
+                          maxPixelSize: maxPixelSize,
+                          quality: quality,
+                          cpuBudget: cpuBudget,
+                          handler: nil)
+        isRunning = false
+    }
+    
+}
+
+class ThumbnailSampler: NSObject, RTCVideoRenderer {
+    
+    weak var service: ThumbnailService?
+    
+    // 以下のプロパティはデコーダーのスレッドとキューの両方から参照するので、
+    // lock で保護する
+    let lock: NSLock = NSLock()
+    var timeInterval: TimeInterval = 5.0
+    var maxPixelSize: Int = 160
+    var quality: Float = 50
+    var cpuBudget: Double = 0.02
+    var handler: ((Snapshot) -> Void)?
+    var isEncoding: Bool = false
+    var nextSampleTime: CFTimeInterval = 0
+    var numberOfThumbnails: Int = 0
+    var numberOfSkippedSamples: Int = 0
+    
+    init(service: ThumbnailService) {
+        self.service = service
+    }
+    
+    func configure(timeInterval: TimeInterval,
+                   maxPixelSize: Int,
+                   quality: Float,
+                   cpuBudget: Double,
+                   handler: ((Snapshot) -> Void)?) {
+        lock.lock()
+        self.timeInterval = timeInterval
+        self.maxPixelSize = maxPixelSize
+        self.quality = quality
+        self.cpuBudget = max(0.001, cpuBudget)
+        self.handler = handler
+        nextSampleTime = 0
+        lock.unlock()
+    }
+    
+    func setSize(_ size: CGSize) {}
+    
+    // デコーダーのスレッドで呼ばれる
+    // ここではフレームを保持してキューに渡すだけにする
+    func renderFrame(_ frame: RTCVideoFrame?) {
+        guard let frame = frame else { return }
+        let now = CACurrentMediaTime()
+        
+        lock.lock()
+        guard handler != nil && now >= nextSampleTime else {
+            lock.unlock()
+            return
+        }
+        if isEncoding {
+            numberOfSkippedSamples += 1
+            lock.unlock()
+            return
+        }
+        isEncoding = true
+        let maxPixelSize = self.maxPixelSize
+        let quality = self.quality
+        lock.unlock()
+        
+        ThumbnailService.queue.async {
+            let start = CACurrentMediaTime()
+            let snapshot = ThumbnailSampler.encode(frame: frame,
+                                                   maxPixelSize: maxPixelSize,
+                                                   quality: quality)
+            let end = CACurrentMediaTime()
+            
+            // 処理にかかった時間を CPU 時間の上限で割った時間だけ
+            // 次のサンプリングを遅らせる
+            self.lock.lock()
+            let cost = end - start
+            let wait = max(self.timeInterval, cost / self.cpuBudget)
+            if wait > self.timeInterval {
+                self.numberOfSkippedSamples += 1
+            }
+            self.nextSampleTime = start + wait
+            self.isEncoding = false
+            let handler = self.handler
+            if snapshot != nil {
+                self.numberOfThumbnails += 1
+            }
+            self.lock.unlock()
+            
+            if let snapshot = snapshot, let handler = handler {
+                DispatchQueue.main.async {
+                    handler(snapshot)
+                }
+            }
+        }
+    }
+    
+    // サムネイルのキュー (シリアルキュー) でのみ使う
+    static let converter: VideoFrameConverter = VideoFrameConverter(pixelOrder: .BGRA)
+    
+    static func encode(frame: RTCVideoFrame,
+                       maxPixelSize: Int,
+                       quality: Float) -> Snapshot? {
+        // フレームのバッファを直接参照して縮小する
+        // (カメラのフレームを I420 に変換しない)
+        let videoFrame = RemoteVideoFrame(nativeVideoFrame: frame)
+        let converted = videoFrame.withPlanes {
+            (planes: VideoFramePlanes) -> VideoFrameBuffer? in
+            let srcWidth = planes.width
+            let srcHeight = planes.height
+            guard srcWidth > 0 && srcHeight > 0 else { return nil }
+            let scale = min(1.0, Double(maxPixelSize) / Double(max(srcWidth, srcHeight)))
+            let width = max(1, Int(Double(srcWidth) * scale))
+            let height = max(1, Int(Double(srcHeight) * scale))
+            let pixels = converter.bufferPool.lease(width: width,
+                                                    height: height,
+                                                    format: .RGB32)
+            guard converter.convert(planes: planes, dest: pixels.data,
+                                    width: width, height: height,
+                                    bytesPerRow: pixels.bytesPerRow) else
+            {
+                return nil
+            }
+            return pixels
+        }
+        guard let pixels = converted ?? nil else { return nil }
+        let width = pixels.width
+        let height = pixels.height
+        let bytesPerRow = pixels.bytesPerRow
+        
+        var output: UnsafeMutablePointer<UInt8>?
+        let size = WebPEncodeBGRA(pixels.data.assumingMemoryBound(to: UInt8.self),
+                                  Int32(width), Int32(height),
+                                  Int32(bytesPerRow), quality, &output)
+        guard size > 0, let buf = output else { return nil }
+        let data = Data(bytes: buf, count: size)
+        WebPFree(buf)
+        
+        // 画素のバッファはサムネイルの画像が解放されるまで保持される
+        guard let provider = pixels.createDataProvider() else {
+            return nil
+        }
+        let bitmapInfo = CGBitmapInfo(rawValue: CGBitmapInfo.byteOrder32Little.rawValue |
+            CGImageAlphaInfo.noneSkipFirst.rawValue)
+        guard let bitmapImage =
+            CGImage(width: width,
+                    height: height,
+                    bitsPerComponent: 8,
+                    bitsPerPixel: 32,
+                    bytesPerRow: bytesPerRow,
+                    space: CGColorSpaceCreateDeviceRGB(),
+                    bitmapInfo: bitmapInfo,
+                    provider: provider,
+                    decode: nil,
+                    shouldInterpolate: true,
+                    intent: CGColorRenderingIntent.defaultIntent) else
+        {
+            return nil
+        }
+        
+        // フレームの回転は画像の向きで表す
+        let orientation: UIImageOrientation
+        switch videoFrame.rotation {
+        case 90:
+            orientation = .right
+        case 180:
+            orientation = .down
+        case 270:
+            orientation = .left
+        default:
+            orientation = .up
+        }
+        let drawnImage = UIImage(cgImage: bitmapImage, scale: 1.0,
+                                 orientation: orientation)
+        let snapshot = Snapshot(bitmapImage: bitmapImage,
+                                drawnImage: drawnImage,
+                                isPartial: false,
+                                numberOfDecodedRows: height)
+        snapshot.data = data
+        return snapshot
+    }
+    
+}
@@ -0,0 +1,195 @@
+import Foundation
+import QuartzCore
+
+// マルチストリームの "update" の処理の統計
+public struct UpdateOfferStatistics {
+    
+    // 受信した update の数
+    public var numberOfReceivedOffers: Int = 0
+    
+    // Answer を送信した update の数
+    public var numberOfAnsweredOffers: Int = 0
+    
+    // 失敗した update の数
+    public var numberOfFailedOffers: Int = 0
+    
+    // 新しい update に置き換えられて適用しなかった update の数
+    public var numberOfCoalescedOffers: Int = 0
+    
+    // 処理中と処理待ちの update の数
+    public var queueDepth: Int = 0
+    
+    // queueDepth の最大値
+    public var maxQueueDepth: Int = 0
+    
+    // update を受信してから Answer を送信するまでの時間 (秒)
+    // 置き換えられた update があれば、置き換えられた中で最も早く受信した時刻から数える
+    public var lastAnswerLatency: TimeInterval?
+    public var maxAnswerLatency: TimeInterval = 0
+    
+    public var averageAnswerLatency: TimeInterval {
+        get {
+            guard numberOfAnsweredOffers > 0 else { return 0 }
+            return totalAnswerLatency / Double(numberOfAnsweredOffers)
+        }
+    }
+    
+    // 最後に適用した update の SDP の大きさ (バイト) と m セクションの数、SSRC の数
+    public var lastOfferSize: Int = 0
+    public var lastNumberOfMediaSections: Int = 0
+    public var lastNumberOfSSRCs: Int = 0
+    public var maxOfferSize: Int = 0
+    
+    // 最後に適用した update の SDP を適用し始めてから Answer を送信するまでの時間 (秒)
+    // キューで待った時間は含まない
+    public var lastApplyTime: TimeInterval?
+    
+    // Answer を送信した update ごとの SDP の大きさと適用にかかった時間
+    // 参加者数に対する SDP の大きさと処理時間の計測に使う
+    // 最新の UpdateOfferStatistics.maxNumberOfSamples 件を保持する
+    public var samples: [UpdateOfferSample] = []
+    
+    public static var maxNumberOfSamples: Int = 100
+    
+    var totalAnswerLatency: TimeInterval = 0
+    
+}
+
+// Answer を送信した update の記録
+public struct UpdateOfferSample {
+    
+    // SDP の大きさ (バイト)
+    public var offerSize: Int
+    
+    // SDP の m セクションの数
+    public var numberOfMediaSections: Int
+    
+    // SDP に含まれる SSRC の数
+    // Plan B では m セクションの数は変わらず、参加者の数に応じて SSRC が増える
+    public var numberOfSSRCs: Int
+    
+    // SDP を適用し始めてから Answer を送信するまでの時間 (秒)
+    public var applyTime: TimeInterval
+    
+}
+
+extension SignalingUpdateOffer {
+    
+    // m セクションと SSRC (cname の属性) の数を数える
+    func countSections() -> (Int, Int) {
+        var numberOfMediaSections = 0
+        var numberOfSSRCs = 0
+        sdp.enumerateLines { line, _ in
+            if line.hasPrefix("m=") {
+                numberOfMediaSections += 1
+            } else if line.hasPrefix("a=ssrc:") && line.contains(" cname:") {
+                numberOfSSRCs += 1
+            }
+        }
+        return (numberOfMediaSections, numberOfSSRCs)
+    }
+    
+}
+
+// update を 1 つずつ適用するためのキュー
+// 処理中の update があれば受信した update を待たせる
+// 処理を待つ update は最新の 1 つのみを保持し、古いものは置き換える
+// (update の SDP はその時点のすべてのストリームを含むので、最新の SDP のみを適用すればよい)
+final class UpdateOfferQueue {
+    
+    struct Item {
+        var offer: SignalingUpdateOffer
+        var arrivalTime: CFTimeInterval
+        var startTime: CFTimeInterval
+    }
+    
+    var current: Item?
+    var pending: Item?
+    var statistics: UpdateOfferStatistics = UpdateOfferStatistics()
+    
+    var isProcessing: Bool {
+        get { return current != nil }
+    }
+    
+    // update を追加する
+    // 処理中の update がなければ、すぐに処理する update を返す
+    func enqueue(_ offer: SignalingUpdateOffer,
+                 time: CFTimeInterval = CACurrentMediaTime()) -> SignalingUpdateOffer? {
+        statistics.numberOfReceivedOffers += 1
+        var item = Item(offer: offer, arrivalTime: time, startTime: time)
+        guard current != nil else {
+            current = item
+            updateQueueDepth()
+            return offer
+        }
+        
+        if let old = pending {
+            statistics.numberOfCoalescedOffers += 1
+            item.arrivalTime = old.arrivalTime
+        }
+        pending = item
+        updateQueueDepth()
+        return nil
+    }
+    
+    // 処理中の update を完了する
+    // 処理を待つ update があれば、次に処理する update を返す
+    func finish(succeeded: Bool,
+                time: CFTimeInterval = CACurrentMediaTime()) -> SignalingUpdateOffer? {
+        guard let finished = current else { return nil }
+        if succeeded {
+            record(finished, time: time)
+            let latency = time - finished.arrivalTime
+            statistics.numberOfAnsweredOffers += 1
+            statistics.lastAnswerLatency = latency
+            statistics.maxAnswerLatency = max(statistics.maxAnswerLatency, latency)
+            statistics.totalAnswerLatency += latency
+        } else {
+            statistics.numberOfFailedOffers += 1
+        }
+        current = pending
+        current?.startTime = time
+        pending = nil
+        updateQueueDepth()
+        return current?.offer
+    }
+    
+    func record(_ item: Item, time: CFTimeInterval) {
+        let size = item.offer.sdp.utf8.count
+        let (numberOfMediaSections, numberOfSSRCs) = item.offer.countSections()
+        let applyTime = time - item.startTime
+        statistics.lastOfferSize = size
+        statistics.lastNumberOfMediaSections = numberOfMediaSections
+        statistics.lastNumberOfSSRCs = numberOfSSRCs
+        statistics.maxOfferSize = max(statistics.maxOfferSize, size)
+        statistics.lastApplyTime = applyTime
+        
+        if statistics.samples.count >= UpdateOfferStatistics.maxNumberOfSamples {
+            statistics.samples.removeFirst()
+        }
+        statistics.samples.append(UpdateOfferSample(offerSize: size,
+                                                    numberOfMediaSections: numberOfMediaSections,
+                                                    numberOfSSRCs: numberOfSSRCs,
+                                                    applyTime: applyTime))
+    }
+    
+    // 処理を待つ update を破棄する
+    func removeAll() {
+        current = nil
+        pending = nil
+        updateQueueDepth()
+    }
+    
+    func updateQueueDepth() {
+        var depth = 0
+        if current != nil {
+            depth += 1
+        }
+        if pending != nil {
+            depth += 1
+        }
+        statistics.queueDepth = depth
+        statistics.maxQueueDepth = max(statistics.maxQueueDepth, depth)
+    }
+    
+}
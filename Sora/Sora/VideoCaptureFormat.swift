@@ -0,0 +1,240 @@
+import Foundation
+import AVFoundation
+import CoreMedia
+import WebRTC
+
+// カメラが対応するキャプチャーのフォーマット
+public struct VideoCaptureFormat {
+    
+    // 横向きの解像度
+    public var width: Int
+    public var height: Int
+    
+    // 対応するフレームレートの範囲
+    public var minFrameRate: Double
+    public var maxFrameRate: Double
+    
+    public let nativeFormat: AVCaptureDeviceFormat
+    
+    init(nativeFormat: AVCaptureDeviceFormat) {
+        self.nativeFormat = nativeFormat
+        let dimensions = CMVideoFormatDescriptionGetDimensions(nativeFormat.formatDescription)
+        width = Int(dimensions.width)
+        height = Int(dimensions.height)
+        let ranges = nativeFormat.videoSupportedFrameRateRanges as? [AVFrameRateRange] ?? []
+        minFrameRate = ranges.map { $0.minFrameRate }.min() ?? 0
+        maxFrameRate = ranges.map { $0.maxFrameRate }.max() ?? 0
+    }
+    
+    var frameRateRanges: [AVFrameRateRange] {
+        get {
+            return nativeFormat.videoSupportedFrameRateRanges as? [AVFrameRateRange] ?? []
+        }
+    }
+    
+    var pixelFormat: FourCharCode {
+        get { return CMFormatDescriptionGetMediaSubType(nativeFormat.formatDescription) }
+    }
+    
+    // 指定したフレームレートに最も近い、対応するフレームレート
+    func supportedFrameRate(nearestTo frameRate: Int) -> Double {
+        let value = Double(frameRate)
+        var nearest = maxFrameRate
+        for range in frameRateRanges {
+            if range.minFrameRate <= value && value <= range.maxFrameRate {
+                return value
+            }
+            let candidate = value < range.minFrameRate ?
+                range.minFrameRate : range.maxFrameRate
+            if abs(candidate - value) < abs(nearest - value) {
+                nearest = candidate
+            }
+        }
+        return nearest
+    }
+    
+}
+
+// キャプチャーの解像度とフレームレートの指定
+// 解像度の向きは問わない (1280x720 と 720x1280 は同じ)
+public struct VideoCaptureSettings {
+    
+    public var width: Int
+    public var height: Int
+    public var frameRate: Int
+    
+    public static let vga: VideoCaptureSettings =
+        VideoCaptureSettings(width: 640, height: 480, frameRate: 30)
+    public static let hd720p: VideoCaptureSettings =
+        VideoCaptureSettings(width: 1280, height: 720, frameRate: 30)
+    public static let hd1080p: VideoCaptureSettings =
+        VideoCaptureSettings(width: 1920, height: 1080, frameRate: 30)
+    
+    public init(width: Int, height: Int, frameRate: Int) {
+        self.width = width
+        self.height = height
+        self.frameRate = frameRate
+    }
+    
+    // 解像度とフレームレートが指定を超えないようにする
+    // 解像度の向きは変えない
+    public func capped(to limit: VideoCaptureSettings) -> VideoCaptureSettings {
+        let long = min(max(width, height), max(limit.width, limit.height))
+        let short = min(min(width, height), min(limit.width, limit.height))
+        return VideoCaptureSettings(width: width >= height ? long : short,
+                                    height: width >= height ? short : long,
+                                    frameRate: min(frameRate, limit.frameRate))
+    }
+    
+    // 指定を満たす最小のフォーマットを選ぶ
+    // 解像度が指定以上で、フレームレートに対応するフォーマットを優先する
+    // 満たすフォーマットがなければ最大のフォーマットを選ぶ
+    // pixelFormat を指定すると、その画素形式のフォーマットのみから選ぶ
+    public func bestFormat(in formats: [VideoCaptureFormat],
+                           pixelFormat: FourCharCode? = nil) -> VideoCaptureFormat? {
+        let long = max(width, height)
+        let short = min(width, height)
+        let candidates = formats.filter {
+            pixelFormat == nil || $0.pixelFormat == pixelFormat! }
+        
+        func area(_ format: VideoCaptureFormat) -> Int {
+            return format.width * format.height
+        }
+        
+        let satisfying = candidates.filter {
+            max($0.width, $0.height) >= long &&
+                min($0.width, $0.height) >= short &&
+                $0.maxFrameRate >= Double(frameRate)
+        }
+        if let best = satisfying.min(by: { area($0) < area($1) }) {
+            return best
+        }
+        return candidates.max {
+            (area($0), $0.maxFrameRate) < (area($1), $1.maxFrameRate)
+        }
+    }
+    
+}
+
+// MARK: - MediaPublisher
+
+extension MediaPublisher {
+    
+    // 使用中のカメラ
+    var captureDevice: AVCaptureDevice? {
+        get {
+            guard let session = captureSession else { return nil }
+            return MediaPublisher.captureDevice(of: session)
+        }
+    }
+    
+    static func captureDevice(of session: AVCaptureSession) -> AVCaptureDevice? {
+        for input in session.inputs {
+            if let input = input as? AVCaptureDeviceInput,
+                input.device.hasMediaType(AVMediaTypeVideo) {
+                return input.device
+            }
+        }
+        return nil
+    }
+    
+    // 使用中のカメラが対応するフォーマット
+    // キャプチャーを開始していなければ nil
+    public var supportedVideoCaptureFormats: [VideoCaptureFormat]? {
+        get {
+            guard let device = captureDevice,
+                let formats = device.formats as? [AVCaptureDeviceFormat] else
+            {
+                return nil
+            }
+            return formats.map { VideoCaptureFormat(nativeFormat: $0) }
+        }
+    }
+    
+    // 使用中のカメラのフォーマット
+    public var activeVideoCaptureFormat: VideoCaptureFormat? {
+        get {
+            guard let format = captureDevice?.activeFormat else { return nil }
+            return VideoCaptureFormat(nativeFormat: format)
+        }
+    }
+    
+    // videoCaptureSettings をカメラに適用する
+    // 出力する映像を指定の解像度とフレームレートに合わせたうえで、
+    // カメラのフォーマットも指定を満たす最小のものに変更して、キャプチャーの負荷を下げる
+    // 再ネゴシエーションは行わない
+    func applyVideoCaptureSettings() {
+        guard let source = mediaCapturer?.videoCaptureSource,
+            let settings = videoCaptureSettings else { return }
+        
+        eventLog?.markFormat(type: eventType,
+                             format: "set video capture settings to %dx%d@%dfps",
+                             arguments: settings.width, settings.height,
+                             settings.frameRate)
+        source.adaptOutputFormat(toWidth: Int32(settings.width),
+                                 height: Int32(settings.height),
+                                 fps: Int32(settings.frameRate))
+        
+        // カメラの切り替えはキャプチャーセッションのキューで行われ、
+        // 切り替え後のカメラのフォーマットは WebRTC が設定する。
+        // 同じキューで変更すれば、切り替えの後に変更できる
+        let session = source.captureSession
+        RTCDispatcher.dispatchAsync(on: .typeCaptureSession) {
+            [weak self] in
+            guard let device = MediaPublisher.captureDevice(of: session) else { return }
+            let result = MediaPublisher.configure(device, with: settings)
+            DispatchQueue.main.async {
+                guard let weakSelf = self else { return }
+                switch result {
+                case .success(let format, let frameRate):
+                    weakSelf.eventLog?.markFormat(type: weakSelf.eventType,
+                                                  format: "set capture device format to %dx%d@%.0ffps",
+                                                  arguments: format.width, format.height,
+                                                  frameRate)
+                case .failure(let reason):
+                    weakSelf.eventLog?.markFormat(type: weakSelf.eventType,
+                                                  format: "failed to set capture device format: %@",
+                                                  arguments: reason)
+                }
+            }
+        }
+    }
+    
+    enum VideoCaptureConfigurationResult {
+        case success(VideoCaptureFormat, Double)
+        case failure(String)
+    }
+    
+    static func configure(_ device: AVCaptureDevice,
+                          with settings: VideoCaptureSettings) -> VideoCaptureConfigurationResult {
+        guard let formats = device.formats as? [AVCaptureDeviceFormat] else {
+            return .failure("no formats")
+        }
+        // WebRTC が選んだ画素形式を変えない
+        let current = VideoCaptureFormat(nativeFormat: device.activeFormat)
+        guard let format = settings.bestFormat(
+            in: formats.map { VideoCaptureFormat(nativeFormat: $0) },
+            pixelFormat: current.pixelFormat) else
+        {
+            return .failure("no format matches")
+        }
+        
+        // 対応しないフレームレートを設定すると例外が発生するので、範囲内に丸める
+        let frameRate = format.supportedFrameRate(nearestTo: settings.frameRate)
+        guard frameRate > 0 else {
+            return .failure("no frame rate ranges")
+        }
+        let duration = CMTime(seconds: 1 / frameRate, preferredTimescale: 600)
+        do {
+            try device.lockForConfiguration()
+        } catch let error {
+            return .failure(error.localizedDescription)
+        }
+        device.activeFormat = format.nativeFormat
+        device.activeVideoMinFrameDuration = duration
+        device.activeVideoMaxFrameDuration = duration
+        device.unlockForConfiguration()
+        return .success(format, frameRate)
+    }
+    
+}
@@ -0,0 +1,276 @@
+import Foundation
+import QuartzCore
+import WebRTC
+
+// 映像の送信を止めて音声のみにする方針
+// ビットレートの単位は kbps
+public struct VideoFallbackPolicy {
+    
+    // 利用可能な帯域がこの値を下回るか、映像のパケットロス率が starvationPacketLossRate 以上であれば帯域不足とする
+    public var starvationBitRate: Int = 150
+    public var starvationPacketLossRate: Double = 0.2
+    
+    // 帯域不足がこの時間 (秒) 続いたら音声のみにする
+    public var starvationDuration: TimeInterval = 5
+    
+    // 音声のみにしてからこの時間 (秒) が経ったら、映像を再開して様子を見る (プローブ)
+    // 映像を止めている間は帯域推定が更新されないので、帯域の回復を待たずに時間で再開する
+    // プローブに失敗して音声のみに戻るたびに 2 倍にし、 maxRecoveryDuration を上限とする
+    public var recoveryDuration: TimeInterval = 10
+    public var maxRecoveryDuration: TimeInterval = 120
+    
+    // プローブ中に帯域不足がこの時間 (秒) 続いたら、プローブを失敗とする
+    // 帯域推定が再び上がるまでの猶予を含める
+    public var probeStarvationDuration: TimeInterval = 3
+    
+    // 映像を再開してからこの時間 (秒) が経ち、利用可能な帯域が recoveryBitRate 以上であればプローブを成功とする
+    // starvationBitRate との差をヒステリシスとする
+    public var probeDuration: TimeInterval = 10
+    public var recoveryBitRate: Int = 300
+    
+    public init() {}
+    
+}
+
+// 映像の送信の状態
+public enum VideoFallbackState: String {
+    
+    // 映像を送信している
+    case video
+    
+    // 帯域不足のため映像を止めている
+    case audioOnly
+    
+    // 映像を再開して、帯域が足りるか様子を見ている
+    case probing
+    
+}
+
+// 映像の送信の状態の遷移
+public struct VideoFallbackTransition {
+    
+    public var previousState: VideoFallbackState
+    public var state: VideoFallbackState
+    
+    // 遷移の理由 (ログ用)
+    public var reason: String
+    
+    // 遷移した時刻 (秒)
+    public var time: TimeInterval
+    
+}
+
+// 映像の送信の判断に使う標本
+public struct VideoFallbackSample {
+    
+    // 帯域推定による利用可能なビットレート (kbps)
+    public var availableBitRate: Int?
+    
+    // 映像のパケットロス率 (0 から 1)
+    public var videoPacketLossRate: Double
+    
+    public init(availableBitRate: Int?, videoPacketLossRate: Double = 0) {
+        self.availableBitRate = availableBitRate
+        self.videoPacketLossRate = videoPacketLossRate
+    }
+    
+}
+
+// 帯域不足が続いたら映像の送信を止めて音声を守り、帯域が回復したら映像を再開する
+// 映像の再開はプローブとして扱い、再開してすぐに帯域不足になれば音声のみに戻して、
+// 次の再開までの待ち時間を延ばす (指数バックオフ)
+// update(_:time:) は接続がなくても使えるので、記録した統計を与えて方針を確認できる
+// メインスレッドからのみ使うこと
+public class VideoFallbackController {
+    
+    public var policy: VideoFallbackPolicy
+    
+    public private(set) var state: VideoFallbackState = .video
+    
+    // 遷移の履歴
+    // 最新の VideoFallbackController.maxNumberOfTransitions 件を保持する
+    public private(set) var transitions: [VideoFallbackTransition] = []
+    
+    public static var maxNumberOfTransitions: Int = 100
+    
+    // 次に映像を再開するまでに必要な、帯域の回復が続く時間 (秒)
+    public private(set) var currentRecoveryDuration: TimeInterval
+    
+    var starvationStartTime: TimeInterval?
+    var stateStartTime: TimeInterval = 0
+    
+    var onTransitionHandler: ((VideoFallbackTransition) -> Void)?
+    
+    public init(policy: VideoFallbackPolicy = VideoFallbackPolicy()) {
+        self.policy = policy
+        currentRecoveryDuration = policy.recoveryDuration
+    }
+    
+    // 状態が遷移したときに呼ばれるハンドラ
+    public func onTransition(handler: @escaping (VideoFallbackTransition) -> Void) {
+        onTransitionHandler = handler
+    }
+    
+    // 標本を与えて状態を更新する
+    // 遷移すれば遷移を返す
+    @discardableResult
+    public func update(_ sample: VideoFallbackSample,
+                       time: TimeInterval = CACurrentMediaTime()) -> VideoFallbackTransition? {
+        let isStarvedByLoss = sample.videoPacketLossRate >= policy.starvationPacketLossRate
+        var isStarved = isStarvedByLoss
+        if let available = sample.availableBitRate, available < policy.starvationBitRate {
+            isStarved = true
+        }
+        if isStarved {
+            if starvationStartTime == nil {
+                starvationStartTime = time
+            }
+        } else {
+            starvationStartTime = nil
+        }
+        
+        switch state {
+        case .video:
+            if let start = starvationStartTime,
+                time - start >= policy.starvationDuration {
+                return transit(to: .audioOnly,
+                               reason: String(format: "starved for %.1f seconds",
+                                              time - start),
+                               time: time)
+            }
+        
+        case .audioOnly:
+            if time - stateStartTime >= currentRecoveryDuration && !isStarvedByLoss {
+                return transit(to: .probing,
+                               reason: String(format: "probe after %.0f seconds",
+                                              currentRecoveryDuration),
+                               time: time)
+            }
+        
+        case .probing:
+            if let start = starvationStartTime,
+                time - start >= policy.probeStarvationDuration {
+                currentRecoveryDuration = min(currentRecoveryDuration * 2,
+                                              policy.maxRecoveryDuration)
+                return transit(to: .audioOnly,
+                               reason: String(format: "probe failed (next probe after %.0f seconds)",
+                                              currentRecoveryDuration),
+                               time: time)
+            }
+            let isRecovered = sample.availableBitRate.map {
+                $0 >= policy.recoveryBitRate } ?? true
+            if time - stateStartTime >= policy.probeDuration && isRecovered {
+                currentRecoveryDuration = policy.recoveryDuration
+                return transit(to: .video, reason: "probe succeeded", time: time)
+            }
+        }
+        return nil
+    }
+    
+    public func reset() {
+        state = .video
+        transitions = []
+        currentRecoveryDuration = policy.recoveryDuration
+        starvationStartTime = nil
+        stateStartTime = 0
+    }
+    
+    func transit(to newState: VideoFallbackState,
+                 reason: String,
+                 time: TimeInterval) -> VideoFallbackTransition {
+        let transition = VideoFallbackTransition(previousState: state,
+                                                 state: newState,
+                                                 reason: reason,
+                                                 time: time)
+        state = newState
+        stateStartTime = time
+        starvationStartTime = nil
+        if transitions.count >= VideoFallbackController.maxNumberOfTransitions {
+            transitions.removeFirst()
+        }
+        transitions.append(transition)
+        onTransitionHandler?(transition)
+        return transition
+    }
+    
+}
+
+// MARK: - 統計からの判断
+
+extension VideoFallbackSample {
+    
+    // 送信の統計を使う
+    init?(collector: StatsCollector) {
+        guard let bandwidth = collector.bandwidth else { return nil }
+        let available = bandwidth.availableSendBitRate
+        var loss = 0.0
+        for stats in collector.latestStats(mediaType: "video", direction: .send) {
+            loss = max(loss, stats.packetLossRate)
+        }
+        self.init(availableBitRate: available.map { $0 / 1000 },
+                  videoPacketLossRate: loss)
+    }
+    
+}
+
+extension PeerConnectionContext {
+    
+    // 統計を取得するたびに映像の送信を判断する
+    // パブリッシャーのみ有効
+    // サブスクライバーはシグナリングで送信の停止を要求できず、受信の帯域を減らせないので対象外とする
+    func startVideoFallback() {
+        guard !isVideoFallbackRunning,
+            role == .publisher,
+            let mediaConnection = mediaConnection,
+            mediaConnection.videoFallbackEnabled,
+            peerConnection?.mediaOption.videoEnabled ?? false else { return }
+        isVideoFallbackRunning = true
+        eventLog?.markFormat(type: .PeerConnection,
+                             format: "start video fallback")
+        
+        let controller = mediaConnection.videoFallbackController
+        controller.reset()
+        statsCollector.addInternalUpdateHandler(key: .videoFallback) {
+            [weak self] collector in
+            guard let weakSelf = self, weakSelf.isVideoFallbackRunning else {
+                return
+            }
+            if let sample = VideoFallbackSample(collector: collector),
+                let transition = controller.update(sample)
+            {
+                weakSelf.eventLog?.markFormat(type: .PeerConnection,
+                                              format: "video fallback: %@ -> %@ (%@)",
+                                              arguments: transition.previousState.rawValue,
+                                              transition.state.rawValue,
+                                              transition.reason)
+                weakSelf.applyVideoFallback(isVideoActive: transition.state != .audioOnly)
+            }
+        }
+        statsCollector.start()
+    }
+    
+    func stopVideoFallback() {
+        isVideoFallbackRunning = false
+        statsCollector.removeInternalUpdateHandler(key: .videoFallback)
+    }
+    
+    // 映像の送信を止める (RTCRtpEncodingParameters.isActive)
+    // 状態が遷移したときのみ呼ぶ
+    func applyVideoFallback(isVideoActive: Bool) {
+        guard isVideoActive == isVideoSuppressed else { return }
+        isVideoSuppressed = !isVideoActive
+        if isVideoActive && peerConnection?.mediaOption.simulcastEnabled ?? false {
+            // サイマルキャストの層の設定に戻す
+            updateSimulcastEncodings()
+            return
+        }
+        for sender in videoSenders {
+            let parameters = sender.parameters
+            for encoding in parameters.encodings {
+                encoding.isActive = isVideoActive
+            }
+            sender.parameters = parameters
+        }
+    }
+    
+}
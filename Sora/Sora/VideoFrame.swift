@@ -1,20 +1,92 @@
 import Foundation
 import CoreMedia
+import CoreVideo
 import WebRTC
 
 public enum VideoFrameHandle {
     case webRTC(RTCVideoFrame)
 }
 
-public protocol VideoFrame {
+public enum VideoFramePixelFormat {
+    
+    // Y, U, V の 3 つのプレーン
+    case I420
+    
+    // Y プレーンと、U と V を交互に並べたプレーン
+    // カメラから取得したフレームの形式
+    case NV12
+    
+}
+
+// 映像フレームの画素データへの参照
+// 画素データはコピーせずにフレームのバッファを直接指す
+// ポインターは VideoFrame.withPlanes(_:) に渡すクロージャーの中でのみ有効で、
+// クロージャーの外に持ち出してはいけない。また、画素データを変更してはいけない
+public struct VideoFramePlanes {
+    
+    public var pixelFormat: VideoFramePixelFormat
+    public var width: Int
+    public var height: Int
+    public var chromaWidth: Int
+    public var chromaHeight: Int
+    
+    public var yPlane: UnsafePointer<UInt8>
+    public var yStride: Int
+    
+    // NV12 では uPlane と vPlane は同じプレーンを指し、
+    // vPlane は uPlane の 1 バイト後になる
+    public var uPlane: UnsafePointer<UInt8>
+    public var uStride: Int
+    public var vPlane: UnsafePointer<UInt8>
+    public var vStride: Int
+    
+    // 同じ行で隣り合う色差の画素の間隔 (I420 は 1, NV12 は 2)
+    public var chromaPixelStride: Int
+    
+    // 輝度と色差がフルレンジ (0-255) であれば true
+    // false であればビデオレンジ (輝度 16-235, 色差 16-240)
+    public var isFullRange: Bool
+    
+}
 
+public protocol VideoFrame {
+    
     var videoFrameHandle: VideoFrameHandle? { get }
     var width: Int { get }
     var height: Int { get }
     var timestamp: CMTime { get }
+    
+    // 時計回りの回転角度 (0, 90, 180, 270)
+    var rotation: Int { get }
+    
+    // フレームがピクセルバッファを持つ場合はそのピクセルバッファ
+    // (カメラから取得したフレームなど)
+    // ピクセルバッファはフレームと同じ期間のみ有効
+    var pixelBuffer: CVPixelBuffer? { get }
+    
+    // 画素データを参照するクロージャーを実行する
+    // 画素データにアクセスできなければクロージャーを実行せずに nil を返す
+    func withPlanes<Result>(_ body: (VideoFramePlanes) throws -> Result) rethrows -> Result?
+    
+}
 
+extension VideoFrame {
+    
+    public var rotation: Int {
+        get { return 0 }
+    }
+    
+    public var pixelBuffer: CVPixelBuffer? {
+        get { return nil }
+    }
+    
+    public func withPlanes<Result>(_ body: (VideoFramePlanes) throws -> Result) rethrows -> Result? {
+        return nil
+    }
+    
 }
 
+// リモートのストリームとローカルのカメラのフレームのどちらにも使う
 struct RemoteVideoFrame: VideoFrame {
     
     var nativeVideoFrame: RTCVideoFrame
@@ -22,7 +94,7 @@ struct RemoteVideoFrame: VideoFrame {
     var videoFrameHandle: VideoFrameHandle? {
         get { return VideoFrameHandle.webRTC(nativeVideoFrame) }
     }
-
+    
     var width: Int {
         get { return nativeVideoFrame.width }
     }
@@ -35,8 +107,86 @@ struct RemoteVideoFrame: VideoFrame {
         get { return CMTimeMake(nativeVideoFrame.timeStampNs, 1000000000) }
     }
     
+    var rotation: Int {
+        get { return Int(nativeVideoFrame.rotation) }
+    }
+    
+    // I420 のバッファを持つフレームはピクセルバッファを持たない
+    // nativeHandle は NULL になりうるが nonnull としてインポートされるので、
+    // Unmanaged として取得して NULL を判断する
+    // (yPlane などを参照すると I420 への変換が行われるので、ここでは参照しない)
+    var pixelBuffer: CVPixelBuffer? {
+        get {
+            guard let handle = nativeVideoFrame
+                .perform(#selector(getter: RTCVideoFrame.nativeHandle)) else
+            {
+                return nil
+            }
+            return unsafeBitCast(handle.takeUnretainedValue(), to: CVPixelBuffer.self)
+        }
+    }
+    
     init(nativeVideoFrame: RTCVideoFrame) {
         self.nativeVideoFrame = nativeVideoFrame
     }
     
+    // ピクセルバッファを持つフレームはロックしたピクセルバッファを、
+    // I420 のバッファを持つフレームはそのバッファを参照する
+    // どちらもバッファの変換やコピーは行わない
+    // yPlane などのプロパティはピクセルバッファを I420 に変換してバッファを確保するので、
+    // ピクセルバッファを持たないフレームでのみ参照する
+    func withPlanes<Result>(_ body: (VideoFramePlanes) throws -> Result) rethrows -> Result? {
+        guard let buffer = pixelBuffer else {
+            let frame = nativeVideoFrame
+            guard let y = frame.yPlane, let u = frame.uPlane, let v = frame.vPlane else {
+                return nil
+            }
+            let planes = VideoFramePlanes(pixelFormat: .I420,
+                                          width: Int(frame.width),
+                                          height: Int(frame.height),
+                                          chromaWidth: Int(frame.chromaWidth),
+                                          chromaHeight: Int(frame.chromaHeight),
+                                          yPlane: y,
+                                          yStride: Int(frame.yPitch),
+                                          uPlane: u,
+                                          uStride: Int(frame.uPitch),
+                                          vPlane: v,
+                                          vStride: Int(frame.vPitch),
+                                          chromaPixelStride: 1,
+                                          isFullRange: false)
+            return try body(planes)
+        }
+        
+        guard CVPixelBufferGetPlaneCount(buffer) == 2 else { return nil }
+        guard CVPixelBufferLockBaseAddress(buffer, .readOnly) == kCVReturnSuccess else {
+            return nil
+        }
+        defer {
+            CVPixelBufferUnlockBaseAddress(buffer, .readOnly)
+        }
+        guard let yBase = CVPixelBufferGetBaseAddressOfPlane(buffer, 0),
+            let uvBase = CVPixelBufferGetBaseAddressOfPlane(buffer, 1) else
+        {
+            return nil
+        }
+        let y = UnsafePointer<UInt8>(yBase.assumingMemoryBound(to: UInt8.self))
+        let uv = UnsafePointer<UInt8>(uvBase.assumingMemoryBound(to: UInt8.self))
+        let uvStride = CVPixelBufferGetBytesPerRowOfPlane(buffer, 1)
+        let planes = VideoFramePlanes(pixelFormat: .NV12,
+                                      width: CVPixelBufferGetWidthOfPlane(buffer, 0),
+                                      height: CVPixelBufferGetHeightOfPlane(buffer, 0),
+                                      chromaWidth: CVPixelBufferGetWidthOfPlane(buffer, 1),
+                                      chromaHeight: CVPixelBufferGetHeightOfPlane(buffer, 1),
+                                      yPlane: y,
+                                      yStride: CVPixelBufferGetBytesPerRowOfPlane(buffer, 0),
+                                      uPlane: uv,
+                                      uStride: uvStride,
+                                      vPlane: uv + 1,
+                                      vStride: uvStride,
+                                      chromaPixelStride: 2,
+                                      isFullRange: CVPixelBufferGetPixelFormatType(buffer) ==
+                                        kCVPixelFormatType_420YpCbCr8BiPlanarFullRange)
+        return try body(planes)
+    }
+    
 }
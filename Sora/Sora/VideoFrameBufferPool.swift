@@ -0,0 +1,286 @@
+import Foundation
+import UIKit
+
+// プールから貸し出すバッファの画素の形式
+public enum VideoFrameBufferFormat {
+    
+    // 1 画素 4 バイトの RGB (BGRA, ARGB など)
+    case RGB32
+    
+    // Y, U, V の 3 つのプレーン
+    case I420
+    
+    // Y プレーンと、U と V を交互に並べたプレーン
+    case NV12
+    
+}
+
+// バッファプールの使用状況
+public struct VideoFrameBufferPoolStatistics {
+    
+    // 新しく確保したバッファの数
+    public var numberOfAllocations: Int = 0
+    
+    // 再利用したバッファの数
+    public var numberOfReuses: Int = 0
+    
+    // 貸し出し中のバッファの数
+    public var numberOfLeasedBuffers: Int = 0
+    
+    // 返却されて再利用を待っているバッファの数
+    public var numberOfIdleBuffers: Int = 0
+    
+    // プールが保持するバッファの合計のバイト数 (貸し出し中を含む)
+    public var totalBytes: Int = 0
+    
+    // totalBytes の最大値
+    public var peakBytes: Int = 0
+    
+    // 待機中のバッファを解放した回数
+    public var numberOfTrims: Int = 0
+    
+    // 再利用できたバッファの割合
+    public var reuseRate: Double {
+        get {
+            let total = numberOfAllocations + numberOfReuses
+            guard total > 0 else { return 0 }
+            return Double(numberOfReuses) / Double(total)
+        }
+    }
+    
+}
+
+// プールから貸し出されたバッファ
+// 参照がなくなるとバッファはプールに返却される
+// 画素データは前回の利用時のままなので、必要であれば呼び出し側で初期化すること
+public class VideoFrameBuffer {
+    
+    public let width: Int
+    public let height: Int
+    public let format: VideoFrameBufferFormat
+    
+    // RGB32 では 1 行のバイト数、I420 と NV12 では Y プレーンの 1 行のバイト数
+    public let bytesPerRow: Int
+    
+    // バッファの大きさ (バイト)
+    public var count: Int {
+        get { return storage.count }
+    }
+    
+    public var data: UnsafeMutableRawPointer {
+        get { return storage.data }
+    }
+    
+    let storage: VideoFrameBufferStorage
+    weak var pool: VideoFrameBufferPool?
+    
+    init(storage: VideoFrameBufferStorage, pool: VideoFrameBufferPool) {
+        self.storage = storage
+        self.pool = pool
+        width = storage.sizeClass.width
+        height = storage.sizeClass.height
+        format = storage.sizeClass.format
+        bytesPerRow = storage.sizeClass.bytesPerRow
+    }
+    
+    deinit {
+        pool?.giveBack(storage)
+    }
+    
+    // バッファを参照する CGDataProvider を生成する
+    // CGDataProvider (と CGImage) が解放されるまでバッファは返却されない
+    public func createDataProvider() -> CGDataProvider? {
+        let info = Unmanaged.passRetained(self).toOpaque()
+        let provider = CGDataProvider(dataInfo: info,
+                                      data: data,
+                                      size: count)
+        {
+            info, _, _ in
+            if let info = info {
+                Unmanaged<VideoFrameBuffer>.fromOpaque(info).release()
+            }
+        }
+        if provider == nil {
+            Unmanaged<VideoFrameBuffer>.fromOpaque(info).release()
+        }
+        return provider
+    }
+    
+}
+
+// 同じ大きさのバッファをまとめる単位
+struct VideoFrameBufferSizeClass: Hashable {
+    
+    var width: Int
+    var height: Int
+    var format: VideoFrameBufferFormat
+    
+    var bytesPerRow: Int {
+        get {
+            switch format {
+            case .RGB32:
+                return width * 4
+            case .I420, .NV12:
+                return width
+            }
+        }
+    }
+    
+    var count: Int {
+        get {
+            switch format {
+            case .RGB32:
+                return width * 4 * height
+            case .I420, .NV12:
+                let chromaWidth = (width + 1) / 2
+                let chromaHeight = (height + 1) / 2
+                return width * height + chromaWidth * chromaHeight * 2
+            }
+        }
+    }
+    
+    var hashValue: Int {
+        get { return width.hashValue ^ (height.hashValue << 16) ^ format.hashValue }
+    }
+    
+    static func ==(lhs: VideoFrameBufferSizeClass,
+                   rhs: VideoFrameBufferSizeClass) -> Bool {
+        return lhs.width == rhs.width &&
+            lhs.height == rhs.height &&
+            lhs.format == rhs.format
+    }
+    
+}
+
+final class VideoFrameBufferStorage {
+    
+    let sizeClass: VideoFrameBufferSizeClass
+    let count: Int
+    let data: UnsafeMutableRawPointer
+    
+    init(sizeClass: VideoFrameBufferSizeClass) {
+        self.sizeClass = sizeClass
+        count = sizeClass.count
+        data = UnsafeMutableRawPointer.allocate(bytes: count, alignedTo: 16)
+    }
+    
+    deinit {
+        data.deallocate(bytes: count, alignedTo: 16)
+    }
+    
+}
+
+// 映像フレームの処理に使うバッファのプール
+// 解像度と形式ごとに返却されたバッファを保持し、次の貸し出しで再利用する
+// 保持する数は、サイズクラスごとに同時に貸し出した数の最大値 (ハイウォーターマーク) までとする
+// メモリ警告を受けると、待機中のバッファをすべて解放してハイウォーターマークを戻す
+// スレッドセーフであり、どのスレッドからでも利用できる
+public class VideoFrameBufferPool {
+    
+    public static let shared: VideoFrameBufferPool = VideoFrameBufferPool()
+    
+    // サイズクラスごとに保持する待機中のバッファの上限
+    public var maxIdleBuffersPerSizeClass: Int = 4
+    
+    public var statistics: VideoFrameBufferPoolStatistics {
+        get {
+            lock.lock()
+            let current = _statistics
+            lock.unlock()
+            return current
+        }
+    }
+    
+    let lock: NSLock = NSLock()
+    var _statistics: VideoFrameBufferPoolStatistics = VideoFrameBufferPoolStatistics()
+    var idleStorages: [VideoFrameBufferSizeClass: [VideoFrameBufferStorage]] = [:]
+    var numberOfLeasedStorages: [VideoFrameBufferSizeClass: Int] = [:]
+    var highWaterMarks: [VideoFrameBufferSizeClass: Int] = [:]
+    var memoryWarningObserver: NSObjectProtocol?
+    
+    public init() {
+        memoryWarningObserver = NotificationCenter
+            .default
+            .addObserver(forName: NSNotification.Name.UIApplicationDidReceiveMemoryWarning,
+                         object: nil,
+                         queue: nil)
+            {
+                [weak self] _ in
+                self?.trim()
+        }
+    }
+    
+    deinit {
+        if let observer = memoryWarningObserver {
+            NotificationCenter.default.removeObserver(observer)
+        }
+    }
+    
+    // バッファを借りる
+    public func lease(width: Int,
+                      height: Int,
+                      format: VideoFrameBufferFormat) -> VideoFrameBuffer {
+        let sizeClass = VideoFrameBufferSizeClass(width: max(1, width),
+                                                  height: max(1, height),
+                                                  format: format)
+        lock.lock()
+        let storage: VideoFrameBufferStorage
+        if var idles = idleStorages[sizeClass], let last = idles.popLast() {
+            idleStorages[sizeClass] = idles
+            storage = last
+            _statistics.numberOfReuses += 1
+            _statistics.numberOfIdleBuffers -= 1
+        } else {
+            storage = VideoFrameBufferStorage(sizeClass: sizeClass)
+            _statistics.numberOfAllocations += 1
+            _statistics.totalBytes += storage.count
+            _statistics.peakBytes = max(_statistics.peakBytes,
+                                        _statistics.totalBytes)
+        }
+        let leased = (numberOfLeasedStorages[sizeClass] ?? 0) + 1
+        numberOfLeasedStorages[sizeClass] = leased
+        highWaterMarks[sizeClass] = max(highWaterMarks[sizeClass] ?? 0, leased)
+        _statistics.numberOfLeasedBuffers += 1
+        lock.unlock()
+        return VideoFrameBuffer(storage: storage, pool: self)
+    }
+    
+    func giveBack(_ storage: VideoFrameBufferStorage) {
+        let sizeClass = storage.sizeClass
+        lock.lock()
+        numberOfLeasedStorages[sizeClass] = max(0, (numberOfLeasedStorages[sizeClass] ?? 1) - 1)
+        _statistics.numberOfLeasedBuffers -= 1
+        
+        var idles = idleStorages[sizeClass] ?? []
+        let limit = min(maxIdleBuffersPerSizeClass,
+                        highWaterMarks[sizeClass] ?? 0)
+        if idles.count < limit {
+            idles.append(storage)
+            idleStorages[sizeClass] = idles
+            _statistics.numberOfIdleBuffers += 1
+        } else {
+            // 保持しないバッファはここで解放される
+            _statistics.totalBytes -= storage.count
+        }
+        lock.unlock()
+    }
+    
+    // 待機中のバッファをすべて解放する
+    // ハイウォーターマークは貸し出し中のバッファの数に戻す
+    public func trim() {
+        lock.lock()
+        var released = 0
+        for (_, idles) in idleStorages {
+            for storage in idles {
+                released += storage.count
+            }
+        }
+        idleStorages = [:]
+        highWaterMarks = numberOfLeasedStorages
+        _statistics.totalBytes -= released
+        _statistics.numberOfIdleBuffers = 0
+        _statistics.numberOfTrims += 1
+        lock.unlock()
+    }
+    
+}
@@ -0,0 +1,352 @@
+import Foundation
+import Accelerate
+
+// 変換後の画素のバイト順 (メモリ上の並び)
+public enum VideoFramePixelOrder {
+    
+    // CGImage の byteOrder32Little | noneSkipFirst (premultipliedFirst) に相当する
+    case BGRA
+    
+    case ARGB
+    
+}
+
+// 縮小の方法
+public enum VideoFrameScalingMethod {
+    
+    // 最近傍法
+    // 変換と同時に縮小するので速いが、画質は劣る
+    case nearest
+    
+    // vImage のリサンプリング (Lanczos)
+    // 元の解像度で変換してから縮小する
+    case resampling
+    
+}
+
+// 映像フレームの画素データを 32 ビットの RGB に変換する
+// 変換、縮小、回転は Accelerate (vImage) のベクトル化された実装で行う
+// 作業用のバッファを再利用するので、スレッドセーフではない。
+// 複数のスレッドから使う場合はスレッドごとにインスタンスを生成すること
+public class VideoFrameConverter {
+    
+    public var pixelOrder: VideoFramePixelOrder
+    
+    public var scalingMethod: VideoFrameScalingMethod = .resampling
+    
+    // 変換先と作業用のバッファを借りるプール
+    public var bufferPool: VideoFrameBufferPool = VideoFrameBufferPool.shared
+    
+    // 元の解像度で変換した画素と、縮小に使う作業用のバッファ
+    var conversionBuffer: VideoFrameBuffer?
+    var scalingBuffer: UnsafeMutableRawPointer?
+    var scalingBufferSize: Int = 0
+    
+    // vImage の変換に使う係数 (ITU-R BT.601)
+    // 形式とレンジの組み合わせごとに一度だけ生成する
+    static var videoRangeI420Conversion: vImage_YpCbCrToARGB =
+        VideoFrameConverter.generateConversion(type: kvImage420Yp8_Cb8_Cr8,
+                                               isFullRange: false)
+    static var fullRangeI420Conversion: vImage_YpCbCrToARGB =
+        VideoFrameConverter.generateConversion(type: kvImage420Yp8_Cb8_Cr8,
+                                               isFullRange: true)
+    static var videoRangeNV12Conversion: vImage_YpCbCrToARGB =
+        VideoFrameConverter.generateConversion(type: kvImage420Yp8_CbCr8,
+                                               isFullRange: false)
+    static var fullRangeNV12Conversion: vImage_YpCbCrToARGB =
+        VideoFrameConverter.generateConversion(type: kvImage420Yp8_CbCr8,
+                                               isFullRange: true)
+    
+    static func generateConversion(type: vImageYpCbCrType,
+                                   isFullRange: Bool) -> vImage_YpCbCrToARGB {
+        var range: vImage_YpCbCrPixelRange
+        if isFullRange {
+            range = vImage_YpCbCrPixelRange(Yp_bias: 0, CbCr_bias: 128,
+                                            YpRangeMax: 255, CbCrRangeMax: 255,
+                                            YpMax: 255, YpMin: 0,
+                                            CbCrMax: 255, CbCrMin: 0)
+        } else {
+            range = vImage_YpCbCrPixelRange(Yp_bias: 16, CbCr_bias: 128,
+                                            YpRangeMax: 235, CbCrRangeMax: 240,
+                                            YpMax: 255, YpMin: 0,
+                                            CbCrMax: 255, CbCrMin: 0)
+        }
+        var info = vImage_YpCbCrToARGB()
+        vImageConvert_YpCbCrToARGB_GenerateConversion(kvImage_YpCbCrToARGBMatrix_ITU_R_601_4,
+                                                      &range,
+                                                      &info,
+                                                      type,
+                                                      kvImageARGB8888,
+                                                      vImage_Flags(kvImageNoFlags))
+        return info
+    }
+    
+    public init(pixelOrder: VideoFramePixelOrder = .BGRA) {
+        self.pixelOrder = pixelOrder
+    }
+    
+    deinit {
+        scalingBuffer?.deallocate(bytes: scalingBufferSize, alignedTo: 16)
+    }
+    
+    // MARK: 変換
+    
+    // フレームを width x height に縮小して変換し、dest に書き込む
+    // dest は少なくとも bytesPerRow * height バイトの領域を指すこと
+    // 画素データにアクセスできなければ false を返す
+    @discardableResult
+    public func convert(videoFrame: VideoFrame,
+                        dest: UnsafeMutableRawPointer,
+                        width: Int,
+                        height: Int,
+                        bytesPerRow: Int) -> Bool {
+        let converted = videoFrame.withPlanes { planes in
+            convert(planes: planes, dest: dest, width: width,
+                    height: height, bytesPerRow: bytesPerRow)
+        }
+        return converted ?? false
+    }
+    
+    // フレームを width x height に縮小して変換し、プールから借りたバッファに書き込む
+    public func convert(videoFrame: VideoFrame,
+                        width: Int,
+                        height: Int) -> VideoFrameBuffer? {
+        let buffer = bufferPool.lease(width: width, height: height, format: .RGB32)
+        guard convert(videoFrame: videoFrame,
+                      dest: buffer.data,
+                      width: buffer.width,
+                      height: buffer.height,
+                      bytesPerRow: buffer.bytesPerRow) else
+        {
+            return nil
+        }
+        return buffer
+    }
+    
+    @discardableResult
+    public func convert(planes: VideoFramePlanes,
+                        dest: UnsafeMutableRawPointer,
+                        width: Int,
+                        height: Int,
+                        bytesPerRow: Int) -> Bool {
+        guard planes.width > 0 && planes.height > 0 &&
+            width > 0 && height > 0 &&
+            bytesPerRow >= width * 4 else
+        {
+            return false
+        }
+        
+        // vImage の 4:2:0 の変換は幅と高さが偶数でなければならない
+        let isEven = planes.width % 2 == 0 && planes.height % 2 == 0
+        let isScaled = width != planes.width || height != planes.height
+        if !isEven || (isScaled && scalingMethod == .nearest) {
+            VideoFrameConverter.convertReference(planes: planes,
+                                                 pixelOrder: pixelOrder,
+                                                 dest: dest,
+                                                 width: width,
+                                                 height: height,
+                                                 bytesPerRow: bytesPerRow)
+            return true
+        }
+        
+        guard isScaled else {
+            return convertWithoutScaling(planes: planes, dest: dest,
+                                         bytesPerRow: bytesPerRow)
+        }
+        
+        // 元の解像度で作業用のバッファに変換してから縮小する
+        let srcBytesPerRow = planes.width * 4
+        let converted = reserveConversionBuffer(width: planes.width,
+                                                height: planes.height)
+        guard convertWithoutScaling(planes: planes, dest: converted,
+                                    bytesPerRow: srcBytesPerRow) else
+        {
+            return false
+        }
+        var src = vImage_Buffer(data: converted,
+                                height: vImagePixelCount(planes.height),
+                                width: vImagePixelCount(planes.width),
+                                rowBytes: srcBytesPerRow)
+        var destBuffer = vImage_Buffer(data: dest,
+                                       height: vImagePixelCount(height),
+                                       width: vImagePixelCount(width),
+                                       rowBytes: bytesPerRow)
+        let tempSize = vImageScale_ARGB8888(&src, &destBuffer, nil,
+                                            vImage_Flags(kvImageGetTempBufferSize))
+        guard tempSize >= 0 else { return false }
+        let temp = reserveScalingBuffer(size: tempSize)
+        return vImageScale_ARGB8888(&src, &destBuffer, temp,
+                                    vImage_Flags(kvImageNoFlags)) == kvImageNoError
+    }
+    
+    func convertWithoutScaling(planes: VideoFramePlanes,
+                               dest: UnsafeMutableRawPointer,
+                               bytesPerRow: Int) -> Bool {
+        var yBuffer = vImage_Buffer(data: UnsafeMutableRawPointer(mutating: planes.yPlane),
+                                    height: vImagePixelCount(planes.height),
+                                    width: vImagePixelCount(planes.width),
+                                    rowBytes: planes.yStride)
+        var destBuffer = vImage_Buffer(data: dest,
+                                       height: vImagePixelCount(planes.height),
+                                       width: vImagePixelCount(planes.width),
+                                       rowBytes: bytesPerRow)
+        
+        // vImage は ARGB で出力するので、BGRA は並び替える
+        let permuteMap: [UInt8]
+        switch pixelOrder {
+        case .BGRA:
+            permuteMap = [3, 2, 1, 0]
+        case .ARGB:
+            permuteMap = [0, 1, 2, 3]
+        }
+        
+        let error: vImage_Error
+        switch planes.pixelFormat {
+        case .I420:
+            var info = planes.isFullRange ?
+                VideoFrameConverter.fullRangeI420Conversion :
+                VideoFrameConverter.videoRangeI420Conversion
+            var uBuffer = vImage_Buffer(data: UnsafeMutableRawPointer(mutating: planes.uPlane),
+                                        height: vImagePixelCount(planes.chromaHeight),
+                                        width: vImagePixelCount(planes.chromaWidth),
+                                        rowBytes: planes.uStride)
+            var vBuffer = vImage_Buffer(data: UnsafeMutableRawPointer(mutating: planes.vPlane),
+                                        height: vImagePixelCount(planes.chromaHeight),
+                                        width: vImagePixelCount(planes.chromaWidth),
+                                        rowBytes: planes.vStride)
+            error = vImageConvert_420Yp8_Cb8_Cr8ToARGB8888(&yBuffer, &uBuffer, &vBuffer,
+                                                           &destBuffer, &info,
+                                                           permuteMap, 255,
+                                                           vImage_Flags(kvImageNoFlags))
+        case .NV12:
+            var info = planes.isFullRange ?
+                VideoFrameConverter.fullRangeNV12Conversion :
+                VideoFrameConverter.videoRangeNV12Conversion
+            var uvBuffer = vImage_Buffer(data: UnsafeMutableRawPointer(mutating: planes.uPlane),
+                                         height: vImagePixelCount(planes.chromaHeight),
+                                         width: vImagePixelCount(planes.chromaWidth),
+                                         rowBytes: planes.uStride)
+            error = vImageConvert_420Yp8_CbCr8ToARGB8888(&yBuffer, &uvBuffer,
+                                                         &destBuffer, &info,
+                                                         permuteMap, 255,
+                                                         vImage_Flags(kvImageNoFlags))
+        }
+        return error == kvImageNoError
+    }
+    
+    // 解像度が変わるまで同じバッファを使い続ける
+    func reserveConversionBuffer(width: Int, height: Int) -> UnsafeMutableRawPointer {
+        if let buffer = conversionBuffer,
+            buffer.width == width && buffer.height == height {
+            return buffer.data
+        }
+        conversionBuffer = nil
+        let buffer = bufferPool.lease(width: width, height: height, format: .RGB32)
+        conversionBuffer = buffer
+        return buffer.data
+    }
+    
+    func reserveScalingBuffer(size: Int) -> UnsafeMutableRawPointer? {
+        guard size > 0 else { return nil }
+        if let buffer = scalingBuffer, scalingBufferSize >= size {
+            return buffer
+        }
+        scalingBuffer?.deallocate(bytes: scalingBufferSize, alignedTo: 16)
+        let buffer = UnsafeMutableRawPointer.allocate(bytes: size, alignedTo: 16)
+        scalingBuffer = buffer
+        scalingBufferSize = size
+        return buffer
+    }
+    
+    // MARK: 回転
+    
+    // 32 ビットの画素を時計回りに rotation 度 (0, 90, 180, 270) 回転する
+    // 90 度と 270 度の場合、dest の幅と高さは src と入れ替わる
+    @discardableResult
+    public static func rotate(src: UnsafeMutableRawPointer,
+                              width: Int,
+                              height: Int,
+                              bytesPerRow: Int,
+                              dest: UnsafeMutableRawPointer,
+                              destBytesPerRow: Int,
+                              rotation: Int) -> Bool {
+        let constant: Int
+        switch rotation {
+        case 0:
+            constant = kRotate0DegreesClockwise
+        case 90:
+            constant = kRotate90DegreesClockwise
+        case 180:
+            constant = kRotate180DegreesClockwise
+        case 270:
+            constant = kRotate270DegreesClockwise
+        default:
+            return false
+        }
+        let isTransposed = rotation == 90 || rotation == 270
+        let destWidth = isTransposed ? height : width
+        let destHeight = isTransposed ? width : height
+        
+        var srcBuffer = vImage_Buffer(data: src,
+                                      height: vImagePixelCount(height),
+                                      width: vImagePixelCount(width),
+                                      rowBytes: bytesPerRow)
+        var destBuffer = vImage_Buffer(data: dest,
+                                       height: vImagePixelCount(destHeight),
+                                       width: vImagePixelCount(destWidth),
+                                       rowBytes: destBytesPerRow)
+        let backColor: [UInt8] = [0, 0, 0, 0]
+        return vImageRotate90_ARGB8888(&srcBuffer, &destBuffer, UInt8(constant),
+                                       backColor, vImage_Flags(kvImageNoFlags)) == kvImageNoError
+    }
+    
+    // MARK: 参照実装
+    
+    // スカラーの参照実装 (ITU-R BT.601)
+    // 縮小は最近傍法で行うので、出力するピクセルの分だけ計算すればよい
+    // vImage が使えない奇数の解像度でも使う
+    public static func convertReference(planes: VideoFramePlanes,
+                                        pixelOrder: VideoFramePixelOrder,
+                                        dest: UnsafeMutableRawPointer,
+                                        width: Int,
+                                        height: Int,
+                                        bytesPerRow: Int) {
+        let srcWidth = planes.width
+        let srcHeight = planes.height
+        let chromaPixelStride = planes.chromaPixelStride
+        
+        // 8 ビットの固定小数点で表した係数
+        let yBias = planes.isFullRange ? 0 : 16
+        let yScale = planes.isFullRange ? 256 : 298
+        let rv = planes.isFullRange ? 359 : 409
+        let gu = planes.isFullRange ? 88 : 100
+        let gv = planes.isFullRange ? 183 : 208
+        let bu = planes.isFullRange ? 454 : 516
+        
+        let (ri, gi, bi, ai) = pixelOrder == .BGRA ? (2, 1, 0, 3) : (1, 2, 3, 0)
+        let bytes = dest.assumingMemoryBound(to: UInt8.self)
+        for dy in 0..<height {
+            let sy = dy * srcHeight / height
+            let yRow = planes.yPlane + sy * planes.yStride
+            let uRow = planes.uPlane + (sy / 2) * planes.uStride
+            let vRow = planes.vPlane + (sy / 2) * planes.vStride
+            let destRow = bytes + dy * bytesPerRow
+            for dx in 0..<width {
+                let sx = dx * srcWidth / width
+                let cx = (sx / 2) * chromaPixelStride
+                let c = yScale * (Int(yRow[sx]) - yBias)
+                let d = Int(uRow[cx]) - 128
+                let e = Int(vRow[cx]) - 128
+                let r = (c + rv * e + 128) >> 8
+                let g = (c - gu * d - gv * e + 128) >> 8
+                let b = (c + bu * d + 128) >> 8
+                let p = destRow + dx * 4
+                p[ri] = UInt8(max(0, min(255, r)))
+                p[gi] = UInt8(max(0, min(255, g)))
+                p[bi] = UInt8(max(0, min(255, b)))
+                p[ai] = 255
+            }
+        }
+    }
+    
+}
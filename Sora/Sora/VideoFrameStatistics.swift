@@ -0,0 +1,204 @@
+import Foundation
+import QuartzCore
+
+// 映像フレームの受信から描画までの統計
+public struct VideoFrameStatistics {
+    
+    // 受信から描画までの遅延のヒストグラムの区切り (ミリ秒)
+    // 最後の区切りより大きい遅延は最後のバケットに数える
+    public static var latencyHistogramBounds: [Double] =
+        [5, 10, 20, 50, 100, 200, 500]
+    
+    // 受信したフレームの数
+    public var numberOfReceivedFrames: Int = 0
+    
+    // 描画したフレームの数
+    public var numberOfRenderedFrames: Int = 0
+    
+    // 描画が間に合わずに破棄したフレームの数
+    public var numberOfDroppedFrames: Int = 0
+    
+    // 複数のフレームをまとめて 1 回の描画で処理した回数
+    public var numberOfCoalescedFrames: Int = 0
+    
+    // 直近 1 秒間の受信フレームレート
+    public var receivedFrameRate: Double = 0
+    
+    // 直近 1 秒間の描画フレームレート
+    public var renderedFrameRate: Double = 0
+    
+    // フレームの受信間隔の揺らぎ (ミリ秒)
+    // RFC 3550 の interarrival jitter と同様に平滑化する
+    public var jitter: Double = 0
+    
+    // 最新のフレームの解像度
+    public var frameSize: CGSize?
+    
+    // 解像度が変化した回数
+    public var numberOfResolutionChanges: Int = 0
+    
+    // 接続してから最初のフレームを受信するまでの時間 (秒)
+    public var timeToFirstFrame: TimeInterval?
+    
+    // 受信から描画までの遅延のヒストグラム
+    // 要素数は latencyHistogramBounds の要素数 + 1
+    public var latencyHistogram: [Int] =
+        [Int](repeating: 0,
+              count: VideoFrameStatistics.latencyHistogramBounds.count + 1)
+    
+    // 受信から描画までの遅延の平均 (ミリ秒)
+    public var averageLatency: Double {
+        get {
+            guard numberOfRenderedFrames > 0 else { return 0 }
+            return totalLatency / Double(numberOfRenderedFrames)
+        }
+    }
+    
+    // 描画 1 回あたりにかかった時間の平均 (ミリ秒)
+    public var averageRenderTime: Double = 0
+    
+    // 映像ビューが表示されていないために描画を止めた間に受け取ったフレームの数
+    public var numberOfPausedFrames: Int = 0
+    
+    // 描画を止めていた時間の合計 (秒)
+    public var pausedTime: TimeInterval = 0
+    
+    // 描画を止めたことで省けた描画の時間の見積もり (秒)
+    // 止めた間に受け取ったフレームの数と描画時間の平均から求める
+    public var estimatedSavedRenderTime: TimeInterval {
+        get { return Double(numberOfPausedFrames) * averageRenderTime / 1000 }
+    }
+    
+    var totalLatency: Double = 0
+    
+}
+
+// 映像フレームの統計を記録する
+// スレッドセーフではないので、呼び出し側で排他制御すること
+// (VideoRendererAdapter ではフレームの受け渡しと同じロックの中で記録する)
+class VideoFrameStatisticsRecorder {
+    
+    var statistics: VideoFrameStatistics = VideoFrameStatistics()
+    var referenceDate: Date
+    
+    var lastArrivalTime: CFTimeInterval?
+    var lastArrivalInterval: CFTimeInterval?
+    
+    var receiveWindowStart: CFTimeInterval = 0
+    var receiveWindowCount: Int = 0
+    var renderWindowStart: CFTimeInterval = 0
+    var renderWindowCount: Int = 0
+    
+    var pauseStartTime: CFTimeInterval?
+    
+    init(referenceDate: Date) {
+        self.referenceDate = referenceDate
+    }
+    
+    func recordReceive(width: Int, height: Int, time: CFTimeInterval) {
+        statistics.numberOfReceivedFrames += 1
+        
+        if statistics.timeToFirstFrame == nil {
+            statistics.timeToFirstFrame = Date().timeIntervalSince(referenceDate)
+        }
+        
+        let size = CGSize(width: width, height: height)
+        if let last = statistics.frameSize, last != size {
+            statistics.numberOfResolutionChanges += 1
+        }
+        statistics.frameSize = size
+        
+        if let last = lastArrivalTime {
+            let interval = time - last
+            if let lastInterval = lastArrivalInterval {
+                let d = abs(interval - lastInterval) * 1000
+                statistics.jitter += (d - statistics.jitter) / 16
+            }
+            lastArrivalInterval = interval
+        }
+        lastArrivalTime = time
+        
+        receiveWindowCount += 1
+        let elapsed = time - receiveWindowStart
+        if elapsed >= 1.0 {
+            statistics.receivedFrameRate = Double(receiveWindowCount) / elapsed
+            receiveWindowStart = time
+            receiveWindowCount = 0
+        }
+    }
+    
+    func recordRender(arrivalTime: CFTimeInterval, time: CFTimeInterval,
+                      renderTime: CFTimeInterval) {
+        statistics.numberOfRenderedFrames += 1
+        
+        // 描画時間は直近の値を重視して平滑化する
+        let renderTimeInMillis = renderTime * 1000
+        if statistics.numberOfRenderedFrames == 1 {
+            statistics.averageRenderTime = renderTimeInMillis
+        } else {
+            statistics.averageRenderTime +=
+                (renderTimeInMillis - statistics.averageRenderTime) / 16
+        }
+        
+        let latency = (time - arrivalTime) * 1000
+        statistics.totalLatency += latency
+        let bounds = VideoFrameStatistics.latencyHistogramBounds
+        var bucket = bounds.count
+        for (i, bound) in bounds.enumerated() {
+            if latency < bound {
+                bucket = i
+                break
+            }
+        }
+        if bucket < statistics.latencyHistogram.count {
+            statistics.latencyHistogram[bucket] += 1
+        }
+        
+        renderWindowCount += 1
+        let elapsed = time - renderWindowStart
+        if elapsed >= 1.0 {
+            statistics.renderedFrameRate = Double(renderWindowCount) / elapsed
+            renderWindowStart = time
+            renderWindowCount = 0
+        }
+    }
+    
+    // 一定時間フレームを受信・描画していなければ、フレームレートを 0 とみなす
+    func currentStatistics(time: CFTimeInterval) -> VideoFrameStatistics {
+        var current = statistics
+        if time - receiveWindowStart > 2.0 {
+            current.receivedFrameRate = 0
+        }
+        if time - renderWindowStart > 2.0 {
+            current.renderedFrameRate = 0
+        }
+        if let start = pauseStartTime {
+            current.pausedTime += time - start
+        }
+        return current
+    }
+    
+    func recordDrop() {
+        statistics.numberOfDroppedFrames += 1
+    }
+    
+    func recordCoalesce() {
+        statistics.numberOfCoalescedFrames += 1
+    }
+    
+    func recordPause(time: CFTimeInterval) {
+        guard pauseStartTime == nil else { return }
+        pauseStartTime = time
+    }
+    
+    func recordResume(time: CFTimeInterval) {
+        guard let start = pauseStartTime else { return }
+        statistics.pausedTime += time - start
+        pauseStartTime = nil
+    }
+    
+    func recordPausedFrame() {
+        statistics.numberOfPausedFrames += 1
+    }
+    
+}
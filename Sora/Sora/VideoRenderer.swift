@@ -11,15 +11,44 @@ public protocol VideoRenderer {
 
 class VideoRendererAdapter: NSObject, RTCVideoRenderer {
     
+    // デコーダーのスレッドから受け取り、描画を待っているフレーム
+    enum PendingFrame {
+        case frame(RTCVideoFrame)
+        case clear
+    }
+    
     weak var connection: Connection?
     var videoRenderer: VideoRenderer
     
+    // メインスレッドの処理が詰まっている間にフレームを受け取っても、
+    // 描画するのは最新のフレームのみにする
+    // 保持するフレームは 1 つだけなので、メインキューにフレームが溜まらない
+    // 以下のプロパティはデコーダーのスレッドとメインスレッドの両方から参照するので、
+    // mailboxLock で保護する
+    let mailboxLock: NSLock = NSLock()
+    var pendingFrame: PendingFrame?
+    var isDrainScheduled: Bool = false
+    
+    var pendingFrameArrivalTime: CFTimeInterval = 0
+    
+    // 前回の描画以降に受け取ったフレームの数
+    var numberOfPendingFrames: Int = 0
+    
+    // true であれば受け取ったフレームを数えるだけで、メインスレッドに渡さない
+    // 映像ビューが表示されていない間にセットされる
+    var isPaused: Bool = false
+    
+    // 統計もフレームの受け渡しと同じロックの中で記録する
+    var statisticsRecorder: VideoFrameStatisticsRecorder
+    
     var eventLog: EventLog? {
         get { return connection?.eventLog }
     }
     
-    init(videoRenderer: VideoRenderer) {
+    init(videoRenderer: VideoRenderer, referenceDate: Date = Date()) {
         self.videoRenderer = videoRenderer
+        statisticsRecorder = VideoFrameStatisticsRecorder(referenceDate:
+            referenceDate)
     }
     
     func setSize(_ size: CGSize) {
@@ -31,17 +60,107 @@ class VideoRendererAdapter: NSObject, RTCVideoRenderer {
         }
     }
     
+    // デコーダーのスレッドで呼ばれる
     func renderFrame(_ frame: RTCVideoFrame?) {
-        DispatchQueue.main.async {
-            if let frame = frame {
-                let frame = RemoteVideoFrame(nativeVideoFrame: frame)
-                self.videoRenderer.render(videoFrame: frame)
-            } else {
-                self.videoRenderer.render(videoFrame: nil)
+        let now = CACurrentMediaTime()
+        let pending: PendingFrame
+        if let frame = frame {
+            pending = .frame(frame)
+        } else {
+            pending = .clear
+        }
+        
+        mailboxLock.lock()
+        if isPaused && frame != nil {
+            statisticsRecorder.recordPausedFrame()
+            mailboxLock.unlock()
+            return
+        }
+        if let frame = frame {
+            statisticsRecorder.recordReceive(width: Int(frame.width),
+                                             height: Int(frame.height),
+                                             time: now)
+        }
+        if pendingFrame != nil {
+            statisticsRecorder.recordDrop()
+        }
+        pendingFrame = pending
+        pendingFrameArrivalTime = now
+        numberOfPendingFrames += 1
+        let needsDrain = !isDrainScheduled
+        isDrainScheduled = true
+        mailboxLock.unlock()
+        
+        if needsDrain {
+            DispatchQueue.main.async {
+                self.drainPendingFrame()
             }
         }
     }
     
+    // メインスレッドで呼ばれる
+    func drainPendingFrame() {
+        mailboxLock.lock()
+        let pending = pendingFrame
+        let arrivalTime = pendingFrameArrivalTime
+        pendingFrame = nil
+        isDrainScheduled = false
+        if numberOfPendingFrames > 1 {
+            statisticsRecorder.recordCoalesce()
+        }
+        numberOfPendingFrames = 0
+        mailboxLock.unlock()
+        
+        switch pending {
+        case .frame(let frame)?:
+            let frame = RemoteVideoFrame(nativeVideoFrame: frame)
+            let start = CACurrentMediaTime()
+            videoRenderer.render(videoFrame: frame)
+            let now = CACurrentMediaTime()
+            mailboxLock.lock()
+            statisticsRecorder.recordRender(arrivalTime: arrivalTime, time: now,
+                                            renderTime: now - start)
+            mailboxLock.unlock()
+        case .clear?:
+            videoRenderer.render(videoFrame: nil)
+        case nil:
+            break
+        }
+    }
+    
+    // 描画を止める、または再開する
+    // 止める時点で描画を待っているフレームは破棄する
+    // 再開後は次に受け取ったフレームから描画する
+    func setPaused(_ paused: Bool) {
+        let now = CACurrentMediaTime()
+        mailboxLock.lock()
+        guard isPaused != paused else {
+            mailboxLock.unlock()
+            return
+        }
+        isPaused = paused
+        if paused {
+            if case .frame? = pendingFrame {
+                pendingFrame = nil
+                statisticsRecorder.recordDrop()
+            }
+            statisticsRecorder.recordPause(time: now)
+        } else {
+            statisticsRecorder.recordResume(time: now)
+        }
+        mailboxLock.unlock()
+        eventLog?.markFormat(type: .VideoRenderer,
+                             format: paused ? "pause rendering" : "resume rendering")
+    }
+    
+    func statistics() -> VideoFrameStatistics {
+        let now = CACurrentMediaTime()
+        mailboxLock.lock()
+        let statistics = statisticsRecorder.currentStatistics(time: now)
+        mailboxLock.unlock()
+        return statistics
+    }
+    
     func render(snapshot: Snapshot) {
         DispatchQueue.main.async {
             self.videoRenderer.render(snapshot: snapshot)
@@ -3,6 +3,34 @@ import WebRTC
 
 public class VideoView: UIView, VideoRenderer {
     
+    public struct NotificationKey {
+        
+        // isVisible が変化したときに通知される
+        public static var onChangeVisibility =
+            Notification.Name("Sora.VideoView.Notification.onChangeVisibility")
+        
+    }
+    
+    // ビューが画面上に表示されていれば true
+    // 自身か親ビューが非表示または透明であるか、ウィンドウの範囲外にあれば false
+    // スクロールビュー内に配置する場合は、スクロールのたびに
+    // updateVisibility() を呼ぶと範囲外に出たことを検出できる
+    public private(set) var isVisible: Bool = false
+    
+    override public var isHidden: Bool {
+        didSet { updateVisibility() }
+    }
+    
+    override public var alpha: CGFloat {
+        didSet { updateVisibility() }
+    }
+    
+    // 親ビューの表示・非表示と透明度の変化を監視するため、親ビューのレイヤーを KVO で監視する
+    // 監視を解除するまでレイヤーを保持する
+    var observedLayers: [CALayer] = []
+    static let observedLayerKeyPaths: [String] = ["hidden", "opacity"]
+    static var observationContext: Int = 0
+    
     // キーウィンドウ外で RTCEAGLVideoView を生成すると次のエラーが発生するため、
     // contentView を Nib ファイルでセットせずに遅延プロパティで初期化する
     // "Failed to bind EAGLDrawable: <CAEAGLLayer: ***> to GL_RENDERBUFFER 1"
@@ -34,6 +62,98 @@ public class VideoView: UIView, VideoRenderer {
         super.init(coder: coder)
     }
     
+    deinit {
+        stopObservingAncestors()
+    }
+    
+    public override func didMoveToSuperview() {
+        super.didMoveToSuperview()
+        observeAncestors()
+        updateVisibility()
+    }
+    
+    public override func didMoveToWindow() {
+        super.didMoveToWindow()
+        observeAncestors()
+        updateVisibility()
+    }
+    
+    // MARK: 親ビューの監視
+    
+    func observeAncestors() {
+        stopObservingAncestors()
+        guard window != nil else { return }
+        var view = superview
+        while let ancestor = view {
+            for keyPath in VideoView.observedLayerKeyPaths {
+                ancestor.layer.addObserver(self,
+                                           forKeyPath: keyPath,
+                                           options: [],
+                                           context: &VideoView.observationContext)
+            }
+            observedLayers.append(ancestor.layer)
+            view = ancestor.superview
+        }
+    }
+    
+    func stopObservingAncestors() {
+        for layer in observedLayers {
+            for keyPath in VideoView.observedLayerKeyPaths {
+                layer.removeObserver(self,
+                                     forKeyPath: keyPath,
+                                     context: &VideoView.observationContext)
+            }
+        }
+        observedLayers = []
+    }
+    
+    public override func observeValue(forKeyPath keyPath: String?,
+                                      of object: Any?,
+                                      change: [NSKeyValueChangeKey : Any]?,
+                                      context: UnsafeMutableRawPointer?) {
+        guard context == &VideoView.observationContext else {
+            super.observeValue(forKeyPath: keyPath, of: object,
+                               change: change, context: context)
+            return
+        }
+        if Thread.isMainThread {
+            updateVisibility()
+        } else {
+            DispatchQueue.main.async { [weak self] in self?.updateVisibility() }
+        }
+    }
+    
+    public override func layoutSubviews() {
+        super.layoutSubviews()
+        updateVisibility()
+    }
+    
+    // 表示されているかどうかを調べ直し、変化していれば通知する
+    public func updateVisibility() {
+        let visible = computeVisibility()
+        guard visible != isVisible else { return }
+        isVisible = visible
+        NotificationCenter
+            .default
+            .post(name: VideoView.NotificationKey.onChangeVisibility,
+                  object: self)
+    }
+    
+    func computeVisibility() -> Bool {
+        guard let window = window, !isHidden, alpha > 0.01 else {
+            return false
+        }
+        var view = superview
+        while let ancestor = view {
+            if ancestor.isHidden || ancestor.alpha <= 0.01 {
+                return false
+            }
+            view = ancestor.superview
+        }
+        let rect = convert(bounds, to: window)
+        return rect.intersects(window.bounds)
+    }
+    
     public func onChangedSize(_ size: CGSize) {
         contentView.onChangedSize(size)
     }
@@ -21,4 +21,445 @@ class SoraTests: XCTestCase {
         }
     }
     
+    // MARK: VideoFrameConverter
+    
+    // 合成した I420 または NV12 の画素データ
+    class TestPlanes {
+        
+        var width: Int
+        var height: Int
+        var pixelFormat: VideoFramePixelFormat
+        var y: [UInt8]
+        var u: [UInt8]
+        var v: [UInt8]
+        
+        init(width: Int, height: Int, pixelFormat: VideoFramePixelFormat) {
+            self.width = width
+            self.height = height
+            self.pixelFormat = pixelFormat
+            let chromaWidth = (width + 1) / 2
+            let chromaHeight = (height + 1) / 2
+            y = [UInt8](repeating: 0, count: width * height)
+            for i in 0..<y.count {
+                y[i] = UInt8((i * 7 + i / width * 13) % 256)
+            }
+            switch pixelFormat {
+            case .I420:
+                u = [UInt8](repeating: 0, count: chromaWidth * chromaHeight)
+                v = [UInt8](repeating: 0, count: chromaWidth * chromaHeight)
+                for i in 0..<u.count {
+                    u[i] = UInt8((i * 5) % 256)
+                    v[i] = UInt8(255 - (i * 3) % 256)
+                }
+            case .NV12:
+                u = [UInt8](repeating: 0, count: chromaWidth * 2 * chromaHeight)
+                v = []
+                for i in 0..<chromaWidth * chromaHeight {
+                    u[i * 2] = UInt8((i * 5) % 256)
+                    u[i * 2 + 1] = UInt8(255 - (i * 3) % 256)
+                }
+            }
+        }
+        
+        func withPlanes(_ body: (VideoFramePlanes) -> Void) {
+            let chromaWidth = (width + 1) / 2
+            let chromaHeight = (height + 1) / 2
+            y.withUnsafeBufferPointer { y in
+                u.withUnsafeBufferPointer {
+                    (u: UnsafeBufferPointer<UInt8>) -> Void in
+                    switch pixelFormat {
+                    case .I420:
+                        v.withUnsafeBufferPointer { v in
+                            body(VideoFramePlanes(pixelFormat: .I420,
+                                                  width: width,
+                                                  height: height,
+                                                  chromaWidth: chromaWidth,
+                                                  chromaHeight: chromaHeight,
+                                                  yPlane: y.baseAddress!,
+                                                  yStride: width,
+                                                  uPlane: u.baseAddress!,
+                                                  uStride: chromaWidth,
+                                                  vPlane: v.baseAddress!,
+                                                  vStride: chromaWidth,
+                                                  chromaPixelStride: 1,
+                                                  isFullRange: false))
+                        }
+                    case .NV12:
+                        body(VideoFramePlanes(pixelFormat: .NV12,
+                                              width: width,
+                                              height: height,
+                                              chromaWidth: chromaWidth,
+                                              chromaHeight: chromaHeight,
+                                              yPlane: y.baseAddress!,
+                                              yStride: width,
+                                              uPlane: u.baseAddress!,
+                                              uStride: chromaWidth * 2,
+                                              vPlane: u.baseAddress! + 1,
+                                              vStride: chromaWidth * 2,
+                                              chromaPixelStride: 2,
+                                              isFullRange: true))
+                    }
+                }
+            }
+        }
+        
+    }
+    
+    // 変換の結果を参照実装と比較する
+    // 係数の丸めが異なるので、各成分の誤差を 3 まで許容する
+    func assertConversionMatchesReference(width: Int, height: Int,
+                                          pixelFormat: VideoFramePixelFormat,
+                                          pixelOrder: VideoFramePixelOrder) {
+        let planes = TestPlanes(width: width, height: height,
+                                pixelFormat: pixelFormat)
+        let converter = VideoFrameConverter(pixelOrder: pixelOrder)
+        var result = [UInt8](repeating: 0, count: width * height * 4)
+        var expected = [UInt8](repeating: 0, count: width * height * 4)
+        planes.withPlanes { planes in
+            XCTAssertTrue(converter.convert(planes: planes, dest: &result,
+                                            width: width, height: height,
+                                            bytesPerRow: width * 4))
+            VideoFrameConverter.convertReference(planes: planes,
+                                                 pixelOrder: pixelOrder,
+                                                 dest: &expected,
+                                                 width: width, height: height,
+                                                 bytesPerRow: width * 4)
+        }
+        var maxError = 0
+        for i in 0..<result.count {
+            maxError = max(maxError, abs(Int(result[i]) - Int(expected[i])))
+        }
+        XCTAssertLessThanOrEqual(maxError, 3)
+    }
+    
+    func testConvertI420ToBGRA() {
+        assertConversionMatchesReference(width: 64, height: 48,
+                                         pixelFormat: .I420, pixelOrder: .BGRA)
+    }
+    
+    func testConvertI420ToARGB() {
+        assertConversionMatchesReference(width: 64, height: 48,
+                                         pixelFormat: .I420, pixelOrder: .ARGB)
+    }
+    
+    func testConvertNV12ToBGRA() {
+        assertConversionMatchesReference(width: 64, height: 48,
+                                         pixelFormat: .NV12, pixelOrder: .BGRA)
+    }
+    
+    // 奇数の解像度は参照実装で変換する
+    func testConvertOddSize() {
+        assertConversionMatchesReference(width: 33, height: 17,
+                                         pixelFormat: .I420, pixelOrder: .BGRA)
+    }
+    
+    func testDownscale() {
+        let planes = TestPlanes(width: 640, height: 480, pixelFormat: .I420)
+        let converter = VideoFrameConverter()
+        var result = [UInt8](repeating: 0, count: 160 * 120 * 4)
+        planes.withPlanes { planes in
+            XCTAssertTrue(converter.convert(planes: planes, dest: &result,
+                                            width: 160, height: 120,
+                                            bytesPerRow: 160 * 4))
+        }
+        // アルファはすべて不透明になる
+        for i in stride(from: 3, to: result.count, by: 4) {
+            XCTAssertEqual(result[i], 255)
+        }
+    }
+    
+    func testRotate() {
+        let width = 4
+        let height = 2
+        var src = [UInt8](repeating: 0, count: width * height * 4)
+        for i in 0..<width * height {
+            src[i * 4] = UInt8(i)
+        }
+        
+        // 90 度回転すると、左下の画素が左上に移る
+        var rotated = [UInt8](repeating: 0, count: src.count)
+        XCTAssertTrue(VideoFrameConverter.rotate(src: &src, width: width, height: height,
+                                                 bytesPerRow: width * 4,
+                                                 dest: &rotated,
+                                                 destBytesPerRow: height * 4,
+                                                 rotation: 90))
+        XCTAssertEqual(rotated[0], UInt8(width))
+        
+        // さらに 270 度回転すると元に戻る
+        var restored = [UInt8](repeating: 0, count: src.count)
+        XCTAssertTrue(VideoFrameConverter.rotate(src: &rotated, width: height, height: width,
+                                                 bytesPerRow: height * 4,
+                                                 dest: &restored,
+                                                 destBytesPerRow: width * 4,
+                                                 rotation: 270))
+        XCTAssertEqual(restored, src)
+        
+        XCTAssertFalse(VideoFrameConverter.rotate(src: &src, width: width, height: height,
+                                                  bytesPerRow: width * 4,
+                                                  dest: &restored,
+                                                  destBytesPerRow: width * 4,
+                                                  rotation: 45))
+    }
+    
+    // 解像度ごとの変換の速度を参照実装と比較する
+    func measureConversion(width: Int, height: Int, useReference: Bool) {
+        let planes = TestPlanes(width: width, height: height, pixelFormat: .I420)
+        let converter = VideoFrameConverter()
+        var result = [UInt8](repeating: 0, count: width * height * 4)
+        planes.withPlanes { planes in
+            self.measure {
+                for _ in 0..<10 {
+                    if useReference {
+                        VideoFrameConverter.convertReference(planes: planes,
+                                                             pixelOrder: .BGRA,
+                                                             dest: &result,
+                                                             width: width,
+                                                             height: height,
+                                                             bytesPerRow: width * 4)
+                    } else {
+                        converter.convert(planes: planes, dest: &result,
+                                          width: width, height: height,
+                                          bytesPerRow: width * 4)
+                    }
+                }
+            }
+        }
+    }
+    
+    func testPerformanceConvert360p() {
+        measureConversion(width: 640, height: 360, useReference: false)
+    }
+    
+    func testPerformanceConvert720p() {
+        measureConversion(width: 1280, height: 720, useReference: false)
+    }
+    
+    func testPerformanceConvert1080p() {
+        measureConversion(width: 1920, height: 1080, useReference: false)
+    }
+    
+    func testPerformanceConvertReference720p() {
+        measureConversion(width: 1280, height: 720, useReference: true)
+    }
+    
+    func testPerformanceDownscale720pToThumbnail() {
+        let planes = TestPlanes(width: 1280, height: 720, pixelFormat: .I420)
+        let converter = VideoFrameConverter()
+        var result = [UInt8](repeating: 0, count: 160 * 90 * 4)
+        planes.withPlanes { planes in
+            self.measure {
+                for _ in 0..<10 {
+                    converter.convert(planes: planes, dest: &result,
+                                      width: 160, height: 90,
+                                      bytesPerRow: 160 * 4)
+                }
+            }
+        }
+    }
+    
+    // MARK: ConnectionQualityEstimator
+    
+    // パケットロス率のみを使い、平滑化前のスコアが score になる標本
+    func qualitySample(score: Double) -> ConnectionQualitySample {
+        let policy = ConnectionQualityPolicy()
+        return ConnectionQualitySample(packetLossRate:
+            (1 - score / 100) * policy.badPacketLossRate)
+    }
+    
+    // 平滑化せず、 1 つの標本で段階を変える推定器
+    func makeUnsmoothedEstimator() -> ConnectionQualityEstimator {
+        var policy = ConnectionQualityPolicy()
+        policy.smoothingFactor = 1
+        policy.numberOfSamplesToChange = 1
+        return ConnectionQualityEstimator(policy: policy)
+    }
+    
+    func testQualityStaysExcellentOnGoodNetwork() {
+        let estimator = ConnectionQualityEstimator()
+        let sample = ConnectionQualitySample(roundTripTime: 0.05,
+                                             packetLossRate: 0,
+                                             jitter: 0.01,
+                                             frameRate: 30,
+                                             expectedFrameRate: 30,
+                                             availableBitRate: 2_000_000,
+                                             requiredBitRate: 1_000_000)
+        for _ in 0..<20 {
+            XCTAssertNil(estimator.update(sample))
+        }
+        XCTAssertEqual(estimator.level, .excellent)
+        XCTAssertEqualWithAccuracy(estimator.score, 100, accuracy: 0.001)
+    }
+    
+    func testQualityDegradesAndRecovers() {
+        let estimator = ConnectionQualityEstimator()
+        var changes: [ConnectionQualityChange] = []
+        estimator.onChange { changes.append($0) }
+        
+        let good = ConnectionQualitySample(roundTripTime: 0.05, packetLossRate: 0)
+        let bad = ConnectionQualitySample(roundTripTime: 1.2, packetLossRate: 0.2,
+                                          frameRate: 5, expectedFrameRate: 30)
+        for _ in 0..<5 {
+            estimator.update(good)
+        }
+        XCTAssertTrue(changes.isEmpty)
+        
+        for _ in 0..<20 {
+            estimator.update(bad)
+        }
+        XCTAssertEqual(estimator.level, .critical)
+        XCTAssertFalse(changes.isEmpty)
+        for change in changes {
+            XCTAssertTrue(change.level < change.previousLevel)
+        }
+        
+        changes = []
+        for _ in 0..<40 {
+            estimator.update(good)
+        }
+        XCTAssertEqual(estimator.level, .excellent)
+        XCTAssertFalse(changes.isEmpty)
+        for change in changes {
+            XCTAssertTrue(change.level > change.previousLevel)
+        }
+    }
+    
+    func testQualityHysteresisPreventsFlapping() {
+        let estimator = makeUnsmoothedEstimator()
+        
+        // 境界 (80) 付近で振動しても段階は変わらない
+        for score in [78.0, 82, 77, 83, 76, 84] {
+            XCTAssertNil(estimator.update(qualitySample(score: score)))
+        }
+        XCTAssertEqual(estimator.level, .excellent)
+        
+        // 境界をヒステリシス以上下回ると下がる
+        let down = estimator.update(qualitySample(score: 74))
+        XCTAssertEqual(down?.previousLevel, .excellent)
+        XCTAssertEqual(down?.level, .good)
+        
+        // 上げるには上の段階の境界をヒステリシス以上超える必要がある
+        for score in [82.0, 78, 84] {
+            XCTAssertNil(estimator.update(qualitySample(score: score)))
+        }
+        XCTAssertEqual(estimator.level, .good)
+        XCTAssertEqual(estimator.update(qualitySample(score: 86))?.level, .excellent)
+    }
+    
+    func testQualityRequiresConsecutiveSamples() {
+        var policy = ConnectionQualityPolicy()
+        policy.smoothingFactor = 1
+        policy.numberOfSamplesToChange = 2
+        let estimator = ConnectionQualityEstimator(policy: policy)
+        
+        // 一時的な劣化では段階を変えない
+        XCTAssertNil(estimator.update(qualitySample(score: 10)))
+        XCTAssertNil(estimator.update(qualitySample(score: 95)))
+        XCTAssertEqual(estimator.level, .excellent)
+        
+        XCTAssertNil(estimator.update(qualitySample(score: 10)))
+        XCTAssertEqual(estimator.update(qualitySample(score: 10))?.level, .critical)
+    }
+    
+    func testQualityIgnoresMissingValues() {
+        // 取得できない値は計算に含めない
+        let sample = ConnectionQualitySample(packetLossRate: 0)
+        XCTAssertEqualWithAccuracy(
+            ConnectionQualityEstimator.score(of: sample,
+                                             policy: ConnectionQualityPolicy()),
+            100, accuracy: 0.001)
+        
+        // 帯域が必要なビットレートの半分であれば、帯域の要素は 0.5 になる
+        var policy = ConnectionQualityPolicy()
+        policy.packetLossWeight = 0
+        let starved = ConnectionQualitySample(packetLossRate: 0,
+                                              availableBitRate: 500_000,
+                                              requiredBitRate: 1_000_000)
+        XCTAssertEqualWithAccuracy(
+            ConnectionQualityEstimator.score(of: starved, policy: policy),
+            50, accuracy: 0.001)
+    }
+    
+    // MARK: - 送信品質の調整
+    
+    struct FixedSensor: PublishingQualitySensor {
+        
+        var cpuUsage: Double?
+        var thermalState: PublishingThermalState
+        
+        func readCPUUsage() -> Double? {
+            return cpuUsage
+        }
+        
+        func readThermalState() -> PublishingThermalState {
+            return thermalState
+        }
+        
+    }
+    
+    func makePublishingQualityController() -> PublishingQualityController {
+        var policy = PublishingQualityPolicy()
+        policy.numberOfSamplesToDowngrade = 2
+        policy.numberOfSamplesToUpgrade = 3
+        policy.holdTimeAfterDowngrade = 10
+        return PublishingQualityController(policy: policy)
+    }
+    
+    func testPublishingQualityDowngradesOnHighCPU() {
+        let controller = makePublishingQualityController()
+        controller.sensor = FixedSensor(cpuUsage: 0.95, thermalState: .nominal)
+        
+        XCTAssertNil(controller.update(controller.sample(stats: nil), time: 0))
+        let decision = controller.update(controller.sample(stats: nil), time: 1)
+        XCTAssertEqual(decision?.previousStepIndex, 0)
+        XCTAssertEqual(decision?.stepIndex, 1)
+        XCTAssertEqual(controller.currentStep?.name, "540p")
+    }
+    
+    func testPublishingQualityDropsToLowestOnCriticalThermalState() {
+        let controller = makePublishingQualityController()
+        controller.sensor = FixedSensor(cpuUsage: 0.1, thermalState: .critical)
+        
+        let decision = controller.update(controller.sample(stats: nil), time: 0)
+        XCTAssertEqual(decision?.stepIndex, controller.policy.steps.count - 1)
+    }
+    
+    func testPublishingQualityUpgradesAfterHoldTime() {
+        let controller = makePublishingQualityController()
+        let high = PublishingQualitySample(cpuUsage: 0.9)
+        let low = PublishingQualitySample(cpuUsage: 0.2)
+        
+        controller.update(high, time: 0)
+        XCTAssertEqual(controller.update(high, time: 1)?.stepIndex, 1)
+        
+        // 下げてから holdTimeAfterDowngrade の間は上げない
+        for time in 2...8 {
+            XCTAssertNil(controller.update(low, time: TimeInterval(time)))
+        }
+        XCTAssertEqual(controller.update(low, time: 11)?.stepIndex, 0)
+        
+        // 上げも下げもしない範囲では段階を変えない
+        let middle = PublishingQualitySample(cpuUsage: 0.6)
+        XCTAssertNil(controller.update(middle, time: 12))
+    }
+    
+    func testVideoCaptureSettingsCapped() {
+        let step = VideoCaptureSettings(width: 360, height: 640, frameRate: 30)
+        let capped = step.capped(to: VideoCaptureSettings(width: 480, height: 320, frameRate: 24))
+        XCTAssertEqual(capped.width, 320)
+        XCTAssertEqual(capped.height, 480)
+        XCTAssertEqual(capped.frameRate, 24)
+    }
+    
+    func testPublishingQualityStartsBelowCaptureSettings() {
+        let controller = makePublishingQualityController()
+        controller.reset(notExceeding: .vga)
+        XCTAssertEqual(controller.currentStep?.name, "360p")
+        
+        // アプリケーションの設定より上げない
+        let low = PublishingQualitySample(cpuUsage: 0.2)
+        for time in 0...5 {
+            XCTAssertNil(controller.update(low, time: TimeInterval(time)))
+        }
+    }
+    
 }